@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2021 Logan Ryan McLintock
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark for m4.
+ * Generates synthetic workloads into a directory, runs m4 on each of them
+ * and reports the throughput and peak memory of the best run.
+ * The workloads are the same on every run, as the text comes from a fixed
+ * seed. The token and call counts are read from the m4 -s statistics,
+ * and are left out for an m4 without -s, or with -t.
+ * POSIX only.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Default sizes, multiplied by the scale */
+#define PROSE_BYTES (32 * 1024 * 1024)
+#define LOOP_NUM 1000000
+#define ROW_NUM 100000
+#define DEF_NUM 100000
+#define DIV_LINES 200000
+/* The m4 from before the series only has diversions 0 to 9 */
+#define DIV_NUM 10
+#define DIV_SHUFFLE 1000
+
+/* Include tree: each file includes BRANCH files, to a depth of DEPTH */
+#define BRANCH 8
+#define DEPTH 4
+#define TREE_LINES 50
+
+#define STATS_FILE "stats.txt"
+
+/* Words that are not built-in macro names */
+char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+    "adipiscing", "elit", "sed", "do", "eiusmod", "tempor", "incididunt",
+    "ut", "labore", "et", "dolore", "magna", "aliqua"
+};
+
+#define NUM_WORDS (sizeof(words) / sizeof(char *))
+
+unsigned long seed = 1;
+
+size_t rnd(size_t n)
+{
+    /* Linear congruential generator, so the text is reproducible */
+    seed = seed * 1103515245UL + 12345UL;
+    return (size_t) ((seed >> 16) & 0x7fff) % n;
+}
+
+size_t prose(FILE *fp, size_t len)
+{
+    /* Writes about len bytes of words and punctuation. Returns the size. */
+    size_t n = 0, col = 0, k;
+    char *w;
+    while (n < len) {
+        w = *(words + rnd(NUM_WORDS));
+        k = strlen(w);
+        if (fputs(w, fp) == EOF)
+            return 0;
+        n += k;
+        col += k;
+        if (col > 70) {
+            if (putc(rnd(4) ? '\n' : '.', fp) == EOF)
+                return 0;
+            col = 0;
+        } else if (putc(rnd(8) ? ' ' : ',', fp) == EOF) {
+            return 0;
+        }
+        ++n;
+    }
+    return n;
+}
+
+FILE *open_file(const char *fn)
+{
+    FILE *fp;
+    if ((fp = fopen(fn, "w")) == NULL)
+        fprintf(stderr, "bench: Cannot open: %s\n", fn);
+    return fp;
+}
+
+size_t close_file(FILE *fp)
+{
+    /* Returns the size of the file, or 0 on error */
+    long n;
+    if (fflush(fp) || (n = ftell(fp)) < 0) {
+        fclose(fp);
+        return 0;
+    }
+    if (fclose(fp))
+        return 0;
+    return n;
+}
+
+size_t gen_prose(size_t scale)
+{
+    /* Plain text with no macros, which is passed straight through */
+    FILE *fp;
+    if ((fp = open_file("prose.m4")) == NULL)
+        return 0;
+    prose(fp, PROSE_BYTES * scale);
+    return close_file(fp);
+}
+
+size_t gen_loop(size_t scale)
+{
+    /* Recursive loop that counts up with ifelse and incr */
+    FILE *fp;
+    if ((fp = open_file("loop.m4")) == NULL)
+        return 0;
+    fprintf(fp, "define(`loop', `ifelse($1, %lu, , `loop(incr($1))')')dnl\n"
+            "loop(0)\n", (unsigned long) (LOOP_NUM * scale));
+    return close_file(fp);
+}
+
+size_t gen_table(size_t scale)
+{
+    /* Wide table rows that use all nine arguments */
+    FILE *fp;
+    size_t k, j;
+    if ((fp = open_file("table.m4")) == NULL)
+        return 0;
+    fprintf(fp, "define(`row', `<tr>$1|$2|$3|$4|$5|$6|$7|$8|$9</tr>')dnl\n");
+    for (k = 0; k < ROW_NUM * scale; ++k) {
+        fprintf(fp, "row(%lu", (unsigned long) k);
+        for (j = 1; j < 9; ++j)
+            fprintf(fp, ", %s", *(words + rnd(NUM_WORDS)));
+        fprintf(fp, ")\n");
+    }
+    return close_file(fp);
+}
+
+size_t gen_defs(size_t scale)
+{
+    /* Many definitions, then a use of each in a random order */
+    FILE *fp;
+    size_t k, n = DEF_NUM * scale;
+    if ((fp = open_file("defs.m4")) == NULL)
+        return 0;
+    for (k = 0; k < n; ++k)
+        fprintf(fp, "define(`m_%lu', `%s')dnl\n", (unsigned long) k,
+                *(words + rnd(NUM_WORDS)));
+    for (k = 0; k < n; ++k)
+        fprintf(fp, "m_%lu\n", (unsigned long) rnd(n));
+    return close_file(fp);
+}
+
+size_t gen_div(size_t scale)
+{
+    /* Lines spread over the diversions, which are moved into each other */
+    FILE *fp;
+    size_t k;
+    if ((fp = open_file("div.m4")) == NULL)
+        return 0;
+    for (k = 0; k < DIV_LINES * scale; ++k) {
+        fprintf(fp, "divert(%lu)line %lu ", (unsigned long) (k % DIV_NUM),
+                (unsigned long) k);
+        prose(fp, 40);
+        if (!(k % DIV_SHUFFLE))
+            fprintf(fp, "divert(%lu)undivert(%lu)dnl\n",
+                    (unsigned long) rnd(DIV_NUM),
+                    (unsigned long) rnd(DIV_NUM));
+    }
+    fprintf(fp, "divert(0)dnl\n");
+    return close_file(fp);
+}
+
+size_t gen_tree(size_t scale, size_t id, size_t depth)
+{
+    /* Tree of included files, numbered like a heap. Returns the total size. */
+    FILE *fp;
+    char fn[64];
+    size_t k, n = 0, t;
+    sprintf(fn, "tree_%lu.m4", (unsigned long) id);
+    if ((fp = open_file(fn)) == NULL)
+        return 0;
+    for (k = 0; k < TREE_LINES * scale; ++k) {
+        prose(fp, 60);
+        if (putc('\n', fp) == EOF) {
+            fclose(fp);
+            return 0;
+        }
+    }
+    if (depth + 1 < DEPTH)
+        for (k = 1; k <= BRANCH; ++k)
+            fprintf(fp, "include(`tree_%lu.m4')",
+                    (unsigned long) (id * BRANCH + k));
+    if (!(n = close_file(fp)))
+        return 0;
+    if (depth + 1 < DEPTH)
+        for (k = 1; k <= BRANCH; ++k) {
+            if (!(t = gen_tree(scale, id * BRANCH + k, depth + 1)))
+                return 0;
+            n += t;
+        }
+    return n;
+}
+
+size_t gen_include(size_t scale)
+{
+    return gen_tree(scale, 0, 0);
+}
+
+struct workload {
+    char *name;
+    char *fn;                   /* File given to m4 */
+    size_t (*gen)(size_t scale);
+};
+
+struct workload work[] = {
+    { "passthrough", "prose.m4", gen_prose },
+    { "recursion", "loop.m4", gen_loop },
+    { "table", "table.m4", gen_table },
+    { "defines", "defs.m4", gen_defs },
+    { "diversions", "div.m4", gen_div },
+    { "include", "tree_0.m4", gen_include }
+};
+
+#define NUM_WORK (sizeof(work) / sizeof(struct workload))
+
+/* Result of one run */
+struct run {
+    double secs;
+    long rss;                   /* Peak resident set size in KiB */
+    unsigned long tokens;
+    unsigned long calls;
+    int counted;                /* The counts were read from -s */
+};
+
+int read_stats(struct run *r)
+{
+    FILE *fp;
+    char name[64];
+    unsigned long x;
+    if ((fp = fopen(STATS_FILE, "r")) == NULL)
+        return 1;
+    while (fscanf(fp, "%63s %lu", name, &x) == 2) {
+        if (!strcmp(name, "tokens")) {
+            r->tokens = x;
+            r->counted = 1;
+        } else if (!strcmp(name, "calls")) {
+            r->calls = x;
+        }
+    }
+    return fclose(fp) == EOF;
+}
+
+int run_m4(const char *m4, const char *fn, int stats, struct run *r)
+{
+    /*
+     * Runs m4 -s fn with the output discarded, or m4 fn when not counting.
+     * Returns 2 when m4 fails, and 1 on other errors.
+     */
+    pid_t pid;
+    int status, fd;
+    struct timeval t0, t1;
+    struct rusage ru;
+
+    if (gettimeofday(&t0, NULL))
+        return 1;
+    if ((pid = fork()) == -1)
+        return 1;
+    if (!pid) {
+        if ((fd = open("/dev/null", O_WRONLY)) == -1 || dup2(fd, 1) == -1)
+            _exit(127);
+        if ((fd = open(STATS_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1
+            || dup2(fd, 2) == -1)
+            _exit(127);
+        if (stats)
+            execl(m4, m4, "-s", fn, (char *) NULL);
+        else
+            execl(m4, m4, fn, (char *) NULL);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) == -1)
+        return 1;
+    if (gettimeofday(&t1, NULL))
+        return 1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        return 2;
+    r->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+#ifdef __APPLE__
+    /* Reported in bytes */
+    r->rss = ru.ru_maxrss / 1024;
+#else
+    r->rss = ru.ru_maxrss;
+#endif
+    r->tokens = r->calls = 0;
+    r->counted = 0;
+    return stats ? read_stats(r) : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *m4 = NULL, *dir = "bench_data", *name = NULL;
+    size_t scale = 1, runs = 3, k, j, size;
+    struct run r, best;
+    char *p;
+    int c, ret, stats = 1, fail = 0;
+
+    while ((c = getopt(argc, argv, "d:n:s:tw:")) != -1) {
+        switch (c) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'n':
+            runs = strtoul(optarg, &p, 10);
+            if (!runs || *p != '\0')
+                goto usage;
+            break;
+        case 's':
+            scale = strtoul(optarg, &p, 10);
+            if (!scale || *p != '\0')
+                goto usage;
+            break;
+        case 't':
+            stats = 0;
+            break;
+        case 'w':
+            name = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind + 1 != argc)
+        goto usage;
+    m4 = *(argv + optind);
+    /* m4 is run from inside the directory */
+    if (*m4 != '/' && (m4 = realpath(m4, NULL)) == NULL) {
+        fprintf(stderr, "bench: Cannot find: %s\n", *(argv + optind));
+        return 1;
+    }
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "bench: Cannot make directory: %s\n", dir);
+        return 1;
+    }
+    if (chdir(dir)) {
+        fprintf(stderr, "bench: Cannot enter directory: %s\n", dir);
+        return 1;
+    }
+
+    printf("%-12s %9s %9s %9s %12s %12s %12s\n", "workload", "MB",
+           "seconds", "MB/s", "tokens/s", "calls/s", "peak_KiB");
+    for (k = 0; k < NUM_WORK; ++k) {
+        if (name != NULL && strcmp(name, (work + k)->name))
+            continue;
+        seed = 1;
+        if (!(size = (work + k)->gen(scale))) {
+            fprintf(stderr, "bench: Failed to generate: %s\n",
+                    (work + k)->name);
+            return 1;
+        }
+        for (j = 0; j < runs; ++j) {
+            ret = run_m4(m4, (work + k)->fn, stats, &r);
+            /* An m4 from before -s existed can still be timed */
+            if (ret == 2 && stats && !run_m4(m4, (work + k)->fn, 0, &r)) {
+                fprintf(stderr, "bench: m4 does not take -s, so the token"
+                        " and call counts are left out\n");
+                stats = 0;
+                ret = 0;
+            }
+            if (ret)
+                break;
+            if (!j || r.secs < best.secs)
+                best = r;
+        }
+        if (ret == 1)
+            return 1;
+        if (ret) {
+            fprintf(stderr, "bench: m4 failed on: %s\n", (work + k)->fn);
+            printf("%-12s %9.2f %9s\n", (work + k)->name, size / 1e6,
+                   "failed");
+            fflush(stdout);
+            fail = 1;
+            continue;
+        }
+        if (best.secs <= 0)
+            best.secs = 1e-6;
+        printf("%-12s %9.2f %9.3f %9.1f ", (work + k)->name, size / 1e6,
+               best.secs, size / 1e6 / best.secs);
+        if (best.counted)
+            printf("%12.0f %12.0f", best.tokens / best.secs,
+                   best.calls / best.secs);
+        else
+            printf("%12s %12s", "-", "-");
+        printf(" %12ld\n", best.rss);
+        fflush(stdout);
+    }
+    return fail;
+    return 0;
+
+  usage:
+    fprintf(stderr, "Usage: %s [-d dir] [-n runs] [-s scale] [-t]"
+            " [-w workload] m4\n", *argv);
+    return 1;
+}
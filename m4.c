@@ -33,6 +33,25 @@
 /* Set to 1 to enable the esyscmd and maketemp built-in macros */
 #define ESYSCMD_MAKETEMP 0
 
+/*
+ * Set to 1 to use a flat, open addressing hash table instead of chained
+ * entries.
+ */
+#define FLAT_HASH_TABLE 0
+
+/*
+ * Set to 1 to hash names a word at a time, instead of a byte at a time
+ * with djb2. This spreads names more evenly over the buckets, but similar
+ * names no longer share cache lines.
+ */
+#define WORD_HASH 0
+
+/*
+ * Set to 0 to find the end of plain text runs with only the scalar scan,
+ * instead of SSE2 or NEON when the compiler targets them.
+ */
+#define SIMD_SCAN 1
+
 #ifdef __linux__
 #define _XOPEN_SOURCE 500
 #endif
@@ -40,17 +59,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
-#if ESYSCMD_MAKETEMP && !defined _WIN32
-#include <sys/wait.h>
-#endif
-
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
 #else
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#if ESYSCMD_MAKETEMP && !defined _WIN32
+#include <spawn.h>
+#include <poll.h>
+extern char **environ;
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -58,16 +87,145 @@
 #include <ctype.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+
+#if SIMD_SCAN && (defined __SSE2__ || defined _M_X64)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#elif SIMD_SCAN && defined __aarch64__ && defined __ARM_NEON
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
 
 #if ESYSCMD_MAKETEMP && defined _WIN32
 #define popen _popen
 #define pclose _pclose
 #endif
 
+#ifdef _WIN32
+#define isatty _isatty
+#define fileno _fileno
+#endif
+
 #define INIT_BUF_SIZE 512
 
+/* Big enough for a size_t in decimal */
+#define NUM_SIZE 24
+
+/* Widest eval result: 64 binary digits, and a sign */
+#define EVAL_WIDTH 64
+#define EVAL_NUM_SIZE (EVAL_WIDTH + 1)
+
+/* Deepest nesting of an eval expression, so a long one cannot overflow */
+#define EVAL_DEPTH 1024
+
+/* eval errors */
+#define EVAL_SYNTAX 1
+#define EVAL_RANGE 2
+#define EVAL_DIV_ZERO 3
+#define EVAL_NEG_EXP 4
+
+/* eval operators of two characters. The others use their character. */
+#define EV_LOR 256
+#define EV_LAND 257
+#define EV_EQ 258
+#define EV_NE 259
+#define EV_LE 260
+#define EV_GE 261
+#define EV_SHL 262
+#define EV_SHR 263
+#define EV_POW 264
+
+/* Block size used when an included file cannot be memory mapped */
+#define FILE_BLOCK_SIZE 65536
+
+#define INIT_NUM_FRAMES 16
+
+/*
+ * Buffers from drained input frames that are kept for reuse, and the
+ * largest buffer that is kept for reuse.
+ */
+#define NUM_SPARE 16
+#define SPARE_MAX_SIZE 65536
+
+/* Completed macro call frames that are kept for reuse */
+#define MCALL_POOL_MAX 64
+
+/* Initial number of argument offsets in a macro call frame */
+#define INIT_NUM_ARGS 16
+
+/* Argument numbers of the special segments $#, $* and $@ */
+#define SEG_NARGS ((size_t) -1)
+#define SEG_STAR ((size_t) -2)
+#define SEG_AT ((size_t) -3)
+
+/*
+ * Initial number of hash table buckets (slots for the flat hash table).
+ * Must be a power of two, as the hash is masked to find the bucket.
+ */
 #define HASH_TABLE_SIZE 16384
 
+/* The hash table doubles when the entries per bucket would exceed this */
+#define MAX_LOAD_FACTOR 1
+
+/* The flat hash table doubles when this percentage of slots would be used */
+#define FLAT_MAX_LOAD 70
+
+/* Number of counters in the hash table membership filter, a power of two */
+#define FILTER_SIZE 8192
+
+/* Number of name bytes stored in a flat hash table slot */
+#define SHORT_NAME 8
+
+/* Flat hash table arena chunk size and entries per slab */
+#define ARENA_CHUNK_SIZE 65536
+#define SLAB_SIZE 256
+
+/*
+ * In batch mode diversion 0 is only written once it reaches this size.
+ * The size of the buffer is rounded up to a multiple of OUT_ALIGN. Its
+ * address is whatever realloc gives, as it grows like any other buffer.
+ */
+#define OUT_THRESHOLD 262144
+#define OUT_ALIGN 4096
+
+/* Diversions past this size are moved from memory to a temporary file */
+#define DIV_BUDGET 16777216
+
+/*
+ * Slots in the cache of pure macro expansions, and the largest arguments
+ * or expansion that are cached
+ */
+#define MEMO_SIZE 1024
+#define MEMO_MAX 65536
+
+/* Slots in the cache of compiled translit maps, and the largest key cached */
+#define TR_SIZE 64
+#define TR_KEY_MAX 1024
+
+/* index uses a plain scan below these lengths of string and substring */
+#define SEARCH_MIN 64
+#define SEARCH_NEEDLE_MIN 4
+
+/* Commands that esyscmd runs at once, and the block their output is read in */
+#define CMD_MAX 16
+#define CMD_BLOCK_SIZE 65536
+
+/* With -j, each file is expanded into the file name with this appended */
+#define JOB_EXT ".out"
+
+/*
+ * Undiverting a diversion that is at least this big moves its buffers,
+ * instead of copying the text.
+ */
+#define MOVE_MIN 4096
+
+/* Initial number of diversions that can be in use */
+#define INIT_NUM_DIVS 4
+
+/* Number of buffers written by one writev call */
+#define IOV_NUM 64
+
 /* size_t Addition OverFlow test */
 #define AOF(a, b) ((a) > SIZE_MAX - (b))
 /* size_t Multiplication OverFlow test */
@@ -76,41 +234,450 @@
 /* Minimum */
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-#define getch(b, read_stdin) (b->i ? *(b->a + --b->i) \
-    : (read_stdin ? getchar() : EOF))
+/* Maximum */
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define getch(in) (in->top != NULL && in->top->i < in->top->s \
+    ? (unsigned char) *(in->top->a + in->top->i++) : getch_slow(in))
 
 #define BUF_FREE_SIZE(b) (b->s - b->i)
 
+/* Token kinds */
+#define TOK_WORD 0              /* Could be a macro name */
+#define TOK_LQ 1                /* Left quote */
+#define TOK_RQ 2                /* Right quote */
+#define TOK_OPEN 3
+#define TOK_CLOSE 4
+#define TOK_COMMA 5
+#define TOK_WS 6                /* Single whitespace char */
+#define TOK_OTHER 7
+
+/*
+ * Char class table entries. The kind is that of a token made of just the
+ * char, and the START and IDENT flags say where the char can be in a word.
+ * The PLAIN flags mark chars that can be copied straight through: outside
+ * of a macro call, inside of a call, and inside of quotes.
+ */
+#define CC_KIND 0x07
+#define CC_START 0x08
+#define CC_IDENT 0x10
+#define CC_PLAIN 0x20
+#define CC_ARG_PLAIN 0x40
+#define CC_QUOTE_PLAIN 0x80
+
+/* Kind of a token of length len that starts with char c */
+#define TOK_KIND(cc, c, len) (len == 1 ? *(cc + c) & CC_KIND : TOK_WORD)
+
+/*
+ * Memory use, for the stats built-in macro and -s. Peaks are taken where a
+ * buffer is used, as buffers move between uses.
+ */
+struct stats {
+    size_t tokens;              /* Tokens read, not counting plain runs */
+    size_t calls;               /* Macro calls */
+    size_t bufs;                /* Buffers allocated */
+    size_t grows;               /* Buffer reallocations */
+    size_t frames;              /* Peak input frames */
+    size_t result;              /* Peak expansion result bytes */
+    size_t args;                /* Peak collected argument bytes */
+    size_t div;                 /* Peak diversion bytes in memory */
+    size_t depth;               /* Peak macro call nesting */
+    size_t memo_hits;           /* Pure macro calls found in the cache */
+    size_t memo_misses;
+};
+
 struct buf {
     char *a;
     size_t i;
     size_t s;
+    struct buf *next;           /* Next buffer in a diversion chain */
+    struct stats *st;           /* Counts the allocations */
+};
+
+/*
+ * Diversion. The text is the spill file, then the chain of buffers moved in
+ * by undivert, then b, which is being written. Once the text in memory
+ * passes the budget, it is moved to the end of the spill file.
+ */
+struct div {
+    struct buf *b;
+    struct buf *first;          /* Chain, NULL when empty */
+    struct buf *last;
+    size_t len;                 /* Number of bytes in the chain */
+    FILE *fp;                   /* Spill file, NULL when not used */
+    size_t num;                 /* Diversion number, negated for discard */
+};
+
+/*
+ * Diversions in use, sorted by number so that they are output in order.
+ * Diversions are made when first diverted to, except diversion 0 which is
+ * always the first. All negative diversions share discard.
+ */
+struct div_list {
+    struct div **d;
+    size_t n;
+    size_t s;
+    struct div *discard;        /* NULL until used */
+    struct stats *st;
+};
+
+/*
+ * Compiled definition segment, either literal text, an argument, or one of
+ * the special segments.
+ */
+struct seg {
+    size_t arg;                 /* Argument number, 0 for literal text */
+    size_t off;                 /* Literal text offset into the definition */
+    size_t len;                 /* Literal text length */
+};
+
+/*
+ * Macro definition, compiled into segments when it is set. Shared by the
+ * hash table entry, macro calls in progress and input frames, and only
+ * freed once there are no holders. The segments and text are stored after
+ * the header.
+ */
+struct def {
+    char *a;                    /* Definition */
+    size_t s;                   /* Space available after the header */
+    size_t refs;                /* Number of holders */
+    struct seg *seg;
+    size_t num_seg;
+    char *strip;                /* Without argument positions, can be a */
+    size_t strip_len;
+};
+
+/*
+ * Frozen file of the hash table and quotes, written by -F and read by -R.
+ * The definitions are stored compiled, so a loaded definition points into
+ * the file and is only copied once it is redefined. The layout is that of
+ * the build, so the file can only be read by the same build of m4.
+ */
+#define FROZEN_MAGIC "m4frozen"
+#define FROZEN_CHECK (sizeof(struct frozen_entry) << 16 \
+    | sizeof(struct seg) << 8 | sizeof(size_t))
+#define FROZEN_ALIGN sizeof(size_t)
+#define FROZEN_PAD(n) ((n + FROZEN_ALIGN - 1) / FROZEN_ALIGN * FROZEN_ALIGN)
+
+struct frozen_head {
+    char magic[8];              /* FROZEN_MAGIC, not null terminated */
+    size_t check;               /* FROZEN_CHECK */
+    size_t size;                /* Size of the file */
+    size_t num;                 /* Number of entries */
+    unsigned char lq;
+    unsigned char rq;
+};
+
+/*
+ * Frozen entry. Followed by the name, then for user defined macros the
+ * segments, definition and stripped definition. Each is null terminated
+ * and the name and definition are padded to FROZEN_ALIGN.
+ */
+struct frozen_entry {
+    size_t len;                 /* Length of name */
+    int bi;
+    int has_def;
+    int own_strip;              /* Stripped definition is stored */
+    int pure;
+    size_t num_seg;
+    size_t def_len;
+    size_t strip_len;
+};
+
+/* Loaded frozen file, which is held until the end */
+struct thaw {
+    char *a;
+    size_t s;
+    int mapped;
+};
+
+/* Input frame types */
+#define FRAME_STR 0             /* Copy in the input string stack */
+#define FRAME_BUF 1             /* Owned buffer, recycled when drained */
+#define FRAME_MEM 2             /* Owned memory, freed when drained */
+#define FRAME_MAP 3             /* Memory mapped file */
+#define FRAME_FILE 4            /* File read in blocks */
+#define FRAME_DEF 5             /* Held macro definition */
+
+/*
+ * Input frame. Frames stack and only the top frame is read, forwards.
+ * A frame is released once it has drained.
+ */
+struct frame {
+    char *a;
+    size_t i;                   /* Read index */
+    size_t s;                   /* Number of bytes available in a */
+    int type;
+    size_t off;                 /* FRAME_STR: Offset into the string stack */
+    struct buf *b;              /* FRAME_BUF: Owner of a */
+    struct def *d;              /* FRAME_DEF: Holder of a */
+    FILE *fp;                   /* FRAME_FILE */
+    /* Profiling of the macro call that pushed the frame, NULL if none */
+    struct prof *prof;
+    clock_t start;
+    clock_t child_time;         /* Time charged to nested macro calls */
+    int memo;                   /* Holds a pure macro expansion being cached */
+};
+
+/*
+ * Input. Pushing text back onto the input adds a frame. Short strings are
+ * copied into the string stack, which grows and shrinks with the frames,
+ * while expansion results are pushed without copying.
+ */
+struct input {
+    struct frame *f;            /* Frame stack */
+    size_t n;                   /* Number of frames */
+    size_t s;                   /* Allocated number of frames */
+    struct frame *top;          /* NULL when there are no frames */
+    struct buf *str;            /* String stack */
+    struct buf *spare[NUM_SPARE];       /* Buffers from drained frames */
+    size_t num_spare;
+    int read_stdin;             /* Read stdin once all frames are drained */
+    int profiling;
+    int memo_popped;            /* A memo frame was released */
+    int memo_word;              /* By reading a word that ended it exactly */
+    struct stats *st;
+    size_t pushed;              /* Bytes pushed onto the input */
+    size_t pushes;              /* Frames pushed */
+};
+
+/*
+ * Profile of a macro. Kept in a list of its own, so that it outlives the
+ * hash table entry.
+ */
+struct prof {
+    struct prof *next;
+    char *name;
+    size_t calls;
+    size_t pushed;              /* Bytes pushed onto the input */
+    size_t emitted;             /* Bytes output from its expansions */
+    clock_t incl;               /* Time, with nested calls */
+    clock_t excl;               /* Time, without nested calls */
+    size_t depth;               /* Expansions being read */
+};
+
+/* Built-in macro opcodes, used to dispatch without comparing names */
+#define BI_NONE 0               /* User defined macro */
+#define BI_DEFINE 1
+#define BI_UNDEFINE 2
+#define BI_CHANGEQUOTE 3
+#define BI_DIVERT 4
+#define BI_DUMPDEF 5
+#define BI_ERRPRINT 6
+#define BI_IFDEF 7
+#define BI_IFELSE 8
+#define BI_INCLUDE 9
+#define BI_LEN 10
+#define BI_INDEX 11
+#define BI_TRANSLIT 12
+#define BI_SUBSTR 13
+#define BI_DNL 14
+#define BI_DIVNUM 15
+#define BI_UNDIVERT 16
+#define BI_ESYSCMD 17
+#define BI_MAKETEMP 18
+#define BI_INCR 19
+#define BI_HTDIST 20
+#define BI_DIRSEP 21
+#define BI_ADD 22
+#define BI_MULT 23
+#define BI_SUB 24
+#define BI_DIV 25
+#define BI_MOD 26
+#define BI_PROFILE 27
+#define BI_STATS 28
+#define BI_DEFINEPURE 29
+#define BI_EVAL 30
+#define NUM_BI 31
+
+/* Built-in macro names, indexed by opcode */
+char *bi_name[NUM_BI] = { NULL, "define", "undefine", "changequote",
+    "divert", "dumpdef", "errprint", "ifdef", "ifelse", "include", "len",
+    "index", "translit", "substr", "dnl", "divnum", "undivert", "esyscmd",
+    "maketemp", "incr", "htdist", "dirsep", "add", "mult", "sub", "div",
+    "mod", "profile", "stats", "definepure", "eval"
 };
 
 /*
  * For hash table entries. Multpile entries at the same hash value link
- * together to form a singularly linked list.
+ * together to form a singularly linked list. In the flat hash table, next
+ * links the free list of deleted entries.
  */
 struct entry {
     struct entry *next;
     char *name;
-    char *def;
+    size_t len;                 /* Length of name */
+    struct def *def;            /* NULL for built-in macros */
+    int bi;                     /* Built-in macro opcode */
+    size_t hash;                /* Full hash of name */
+    struct prof *prof;          /* NULL unless profiled */
+    int pure;                   /* Defined by definepure */
+};
+
+#if FLAT_HASH_TABLE
+/*
+ * Flat hash table slot. The hash and the start of the name are inline, so
+ * that most probes do not touch the entry.
+ */
+struct slot {
+    size_t hash;
+    char sn[SHORT_NAME];        /* Start of name, zero padded */
+    struct entry *e;            /* NULL when empty */
+};
+
+/* Arena chunk. The bytes follow the header. */
+struct chunk {
+    struct chunk *next;
+    size_t i;                   /* Bytes used */
+    size_t s;                   /* Bytes available */
 };
 
+/* Block of entries, so that entries do not move when the table grows */
+struct slab {
+    struct slab *next;
+    struct entry e[SLAB_SIZE];
+};
+
+/*
+ * Open addressing hash table with linear probing. Names and definitions
+ * are stored in the arena. Grows by doubling when FLAT_MAX_LOAD is
+ * exceeded.
+ */
+struct hash_table {
+    struct slot *slot;
+    size_t s;                   /* Number of slots, a power of two */
+    size_t n;                   /* Number of entries */
+    struct chunk *arena;        /* Head is the chunk being filled */
+    struct slab *slab;          /* Head is the slab being filled */
+    size_t slab_i;              /* Entries used in the head slab */
+    struct entry *free_e;       /* Deleted entries */
+    size_t filter[FILTER_SIZE]; /* Number of names at each filter index */
+};
+#else
+/* Hash table that grows by doubling when the load factor is exceeded */
+struct hash_table {
+    struct entry **b;           /* Buckets */
+    size_t s;                   /* Number of buckets */
+    size_t n;                   /* Number of entries */
+    size_t filter[FILTER_SIZE]; /* Number of names at each filter index */
+};
+#endif
+
 /*
  * mcall used to stack on nested macro calls.
- * Only argument buffers 1 to 9 are used (index 0 will be NULL).
+ * All arguments are collected into one buffer, each null terminated, and
+ * arg_off holds where each starts. Arguments are numbered from 1. Once the
+ * arguments are terminated, arg_off also holds the end of the last one.
  */
 struct mcall {
     struct mcall *next;
-    char *name;                 /* Macro name */
-    char *def;                  /* Macro definition before substitution */
+    int bi;                     /* Built-in macro opcode */
+    struct def *def;            /* Macro definition before substitution */
+    struct prof *prof;          /* NULL unless profiling */
     size_t bracket_depth;       /* Only unquoted brackets are counted */
     size_t act_arg;             /* The current argument being collected */
-    struct buf *arg_buf[10];    /* For argument collection */
+    struct buf *args;           /* For argument collection */
+    size_t *arg_off;
+    size_t arg_s;               /* Number of offsets allocated */
+    size_t depth;               /* Nesting, 1 for the outermost call */
+    int pure;                   /* The macro was defined by definepure */
+};
+
+/*
+ * Token read by getword. The span is a, len. It points into the input
+ * frame when possible, otherwise into ch or b, and is only valid until
+ * the input is next changed.
+ */
+struct token {
+    int kind;
+    char *a;
+    size_t len;
+    char ch;                    /* Single char read from stdin */
+    struct buf *b;              /* Word that crossed a frame boundary */
+    struct prof *prof;          /* Expansion read from, when profiling */
+};
+
+/*
+ * Cached expansion of a pure macro, keyed on the definition and the
+ * collected arguments. Entries from before a change of the definitions or
+ * quotes have an old generation and do not match.
+ */
+struct memo_slot {
+    size_t gen;                 /* 0 when empty */
+    struct def *def;            /* Only compared, not held */
+    char *key;                  /* Arguments, each null terminated */
+    size_t key_len;
+    char *out;                  /* Fully expanded output */
+    size_t out_len;
+    int args_ok;                /* Can be output into collected arguments */
+};
+
+/*
+ * Cache of pure macro expansions. A missed call is recorded by tagging the
+ * frame of its result. Once the frame has drained at the start of a token,
+ * with the same output, diversion, macro call and quote depth as at the
+ * start, the text added to the output since is the expansion. Anything
+ * else, such as reading past the frame while in a token, stops the
+ * recording.
+ */
+struct memo {
+    struct memo_slot slot[MEMO_SIZE];
+    size_t gen;                 /* Changed with the definitions or quotes */
+    int on;                     /* Recording */
+    struct memo_slot rec;
+    struct mcall *stack;
+    struct div *act;
+    struct buf *out;            /* NULL until the call is removed */
+    size_t off;                 /* Start of the expansion in out */
+};
+
+/*
+ * Compiled translit map, cached by the from and to strings. Each byte
+ * becomes map[byte], and is dropped when keep[byte] is 0.
+ */
+struct tr_map {
+    char *key;                  /* from then to, NULL when empty */
+    size_t from_len;
+    size_t to_len;
+    int del;                    /* Some bytes are dropped */
+    unsigned char map[UCHAR_MAX + 1];
+    unsigned char keep[UCHAR_MAX + 1];
+};
+
+/*
+ * Processor. Holds all of the state, so that several can be used at once
+ * in one program. expand works on copies of the fields, which it stores
+ * back when it returns.
+ */
+struct m4 {
+    struct input *input;
+    struct token token;
+    struct token next_token;
+    struct buf *result;
+    struct hash_table *ht;
+    struct div_list divs;
+    struct div *act;            /* Active diversion */
+    /* Char class table, which also holds the quote chars */
+    unsigned char cc[UCHAR_MAX + 1];
+    unsigned char lq;
+    unsigned char rq;
+    int quote_on;
+    size_t quote_depth;
+    struct mcall *stack;
+    struct mcall *pool;
+    size_t pool_n;
+    int interactive;            /* Write diversion 0 after every token */
+    size_t out_threshold;       /* Write diversion 0 once this big */
+    size_t div_budget;
+    int profiling;
+    struct prof *profs;
+    struct stats st;
+    struct thaw frz;
+    struct memo memo;
+    struct tr_map tr[TR_SIZE];
 };
 
-struct buf *init_buf(void)
+struct buf *init_buf(struct stats *st)
 {
     struct buf *b;
     if ((b = malloc(sizeof(struct buf))) == NULL)
@@ -121,6 +688,9 @@ struct buf *init_buf(void)
     }
     b->s = INIT_BUF_SIZE;
     b->i = 0;
+    b->next = NULL;
+    b->st = st;
+    ++st->bufs;
     return b;
 }
 
@@ -149,6 +719,7 @@ int grow_buf(struct buf *b, size_t will_use)
         return 1;
     b->a = t;
     b->s = new_s;
+    ++b->st->grows;
     return 0;
 }
 
@@ -160,681 +731,3344 @@ int ungetch(struct buf *b, int ch)
     return *(b->a + b->i++) = ch;
 }
 
-int filesize(char *fn, size_t * fs)
+void delete_buf(struct buf *b)
 {
-    /* Gets the filesize of a filename */
-    struct stat st;
-    if (stat(fn, &st))
-        return 1;
+    b->i = 0;
+}
 
-#ifndef S_ISREG
-#define S_ISREG(m) ((m & S_IFMT) == S_IFREG)
+void release_def(struct def *d)
+{
+    /*
+     * Drops a hold on a definition, freeing it when there are no holders.
+     * Space in the arena of the flat hash table is not returned.
+     */
+    if (d != NULL && !--d->refs) {
+#if !FLAT_HASH_TABLE
+        free(d);
 #endif
+    }
+}
 
-    if (!S_ISREG(st.st_mode))
-        return 1;
-    if (st.st_size < 0)
-        return 1;
-    *fs = st.st_size;
-    return 0;
+struct input *init_input(struct stats *st)
+{
+    struct input *in;
+    if ((in = calloc(1, sizeof(struct input))) == NULL)
+        return NULL;
+    if ((in->f = malloc(INIT_NUM_FRAMES * sizeof(struct frame))) == NULL) {
+        free(in);
+        return NULL;
+    }
+    in->s = INIT_NUM_FRAMES;
+    in->st = st;
+    if ((in->str = init_buf(st)) == NULL) {
+        free(in->f);
+        free(in);
+        return NULL;
+    }
+    return in;
 }
 
-int include(struct buf *b, char *fn)
+struct buf *get_spare(struct input *in)
 {
-    FILE *fp;
-    int x;
-    size_t fs;
-    size_t back_i;
+    /* Gets an empty buffer, reusing one from a drained frame if possible */
+    struct buf *b;
+    if (in->num_spare) {
+        b = *(in->spare + --in->num_spare);
+        delete_buf(b);
+        return b;
+    }
+    return init_buf(in->st);
+}
 
-    if (filesize(fn, &fs))
-        return 1;
-    if (fs > BUF_FREE_SIZE(b) && grow_buf(b, fs))
-        return 1;
-    if ((fp = fopen(fn, "rb")) == NULL)
-        return 1;
-    back_i = b->i + fs;
+void recycle_buf(struct input *in, struct buf *b)
+{
+    /* Keeps a buffer for reuse, unless there are enough or it is large */
+    if (in->num_spare < NUM_SPARE && b->s <= SPARE_MAX_SIZE)
+        *(in->spare + in->num_spare++) = b;
+    else
+        free_buf(b);
+}
 
-    errno = 0;
-    while ((x = getc(fp)) != EOF)
-        *(b->a + --back_i) = x;
+void prof_pop(struct input *in, struct frame *f)
+{
+    /*
+     * Charges the time of reading a frame pushed by a profiled macro call
+     * to the macro, and to the enclosing profiled frame.
+     */
+    struct prof *p = f->prof;
+    clock_t t = clock() - f->start;
+    size_t k = f - in->f;
+    /* Only the outermost expansion of a recursive macro is counted */
+    if (!--p->depth)
+        p->incl += t;
+    p->excl += t - f->child_time;
+    while (k--)
+        if ((in->f + k)->prof != NULL) {
+            (in->f + k)->child_time += t;
+            break;
+        }
+}
 
-    if (errno) {
-        fclose(fp);
-        return 1;
+struct prof *frame_prof(struct input *in)
+{
+    /* Profile of the innermost frame being read with a profiled call */
+    struct frame *f;
+    size_t k = in->n;
+    while (k--) {
+        f = in->f + k;
+        if (f->prof != NULL && f->i < f->s)
+            return f->prof;
     }
-    if (fclose(fp))
-        return 1;
-
-    /* Check */
-    if (back_i != b->i)
-        return 1;
-
-    /* Success */
-    b->i += fs;
+    return NULL;
+}
 
-    return 0;
+void pop_frame(struct input *in)
+{
+    struct frame *f = in->top;
+    if (f->prof != NULL)
+        prof_pop(in, f);
+    if (f->memo)
+        in->memo_popped = 1;
+    switch (f->type) {
+    case FRAME_STR:
+        in->str->i = f->off;
+        break;
+    case FRAME_BUF:
+        recycle_buf(in, f->b);
+        break;
+    case FRAME_MEM:
+        free(f->a);
+        break;
+    case FRAME_DEF:
+        release_def(f->d);
+        break;
+    case FRAME_MAP:
+#ifndef _WIN32
+        munmap(f->a, f->s);
+#endif
+        break;
+    case FRAME_FILE:
+        fclose(f->fp);
+        free(f->a);
+        break;
+    }
+    in->top = --in->n ? f - 1 : NULL;
 }
 
-void delete_buf(struct buf *b)
+void free_input(struct input *in)
 {
-    b->i = 0;
+    size_t k;
+    if (in != NULL) {
+        while (in->top != NULL)
+            pop_frame(in);
+        for (k = 0; k < in->num_spare; ++k)
+            free_buf(*(in->spare + k));
+        free_buf(in->str);
+        free(in->f);
+        free(in);
+    }
 }
 
-int getword(struct buf *token, struct buf *input, int read_stdin, int *err)
+struct frame *push_frame(struct input *in, int type)
 {
-    int x;
-    delete_buf(token);
+    /* Adds a new frame to the top of the stack. Returns NULL on error. */
+    struct frame *t;
+    int memo = 0;
+    /*
+     * Release drained frames first, so that tail recursion does not stack.
+     * Text pushed when a memo frame has drained continues the expansion.
+     */
+    while (in->top != NULL && in->top->i == in->top->s
+           && in->top->type != FRAME_FILE) {
+        memo |= in->top->memo;
+        pop_frame(in);
+    }
+    if (in->n == in->s) {
+        if (MOF(in->s, 2 * sizeof(struct frame)))
+            return NULL;
+        if ((t = realloc(in->f, in->s * 2 * sizeof(struct frame))) == NULL)
+            return NULL;
+        in->f = t;
+        in->s *= 2;
+    }
+    in->top = in->f + in->n++;
+    if (in->n > in->st->frames)
+        in->st->frames = in->n;
+    memset(in->top, 0, sizeof(struct frame));
+    in->top->type = type;
+    in->top->prof = NULL;
+    if (memo) {
+        in->top->memo = 1;
+        in->memo_popped = 0;
+        in->memo_word = 0;
+    }
+    ++in->pushes;
+    return in->top;
+}
 
-    /* Always read at least one char */
-    errno = 0;
-    if ((x = getch(input, read_stdin)) == EOF) {
-        if (errno)
-            *err = 1;
+int read_block(struct frame *f)
+{
+    /* Refills the block buffer. Returns 1 on error or end of file. */
+    f->i = 0;
+    f->s = fread(f->a, 1, FILE_BLOCK_SIZE, f->fp);
+    if (!f->s) {
+        if (ferror(f->fp) && !errno)
+            errno = EIO;
         return 1;
     }
-    /* EOF, no error */
-    if (ungetch(token, x) == EOF)
-        return 1;
+    return 0;
+}
 
-    if (isalpha(x) || x == '_') {
-        /* Could be the start of a macro name */
-        while (1) {
-            /* Read another char */
-            errno = 0;
-            if ((x = getch(input, read_stdin)) == EOF) {
-                if (errno)
-                    *err = 1;
-                return 1;
-            }
-            if (!(isalnum(x) || x == '_')) {
-                /* Read past the end of the token, so put the char back */
-                if (ungetch(input, x) == EOF) {
-                    *err = 1;
-                    return 1;
-                }
-                break;
-            } else {
-                /* Store the char */
-                if (ungetch(token, x) == EOF) {
-                    *err = 1;
-                    return 1;
-                }
-            }
-        }
+int getch_slow(struct input *in)
+{
+    /* Drains the top frames until a char is available */
+    struct frame *f;
+    while ((f = in->top) != NULL) {
+        if (f->i < f->s)
+            return (unsigned char) *(f->a + f->i++);
+        if (f->type == FRAME_FILE && !read_block(f))
+            continue;
+        if (errno)
+            return EOF;
+        pop_frame(in);
     }
-    /* Null terminate token */
-    if (ungetch(token, '\0') == EOF) {
-        *err = 1;
+    return in->read_stdin ? getchar() : EOF;
+}
+
+int unread(struct input *in, char *s, size_t len)
+{
+    /*
+     * Puts s back into the consumed part of the top frame, which avoids
+     * making a new frame. This is always possible for a read-only frame
+     * when s is what was just read from it. Returns 1 if not possible.
+     */
+    struct frame *f = in->top;
+    if (f == NULL || f->i < len)
         return 1;
+    /* s is a span of the frame that was just read */
+    if (f->a + f->i - len == s) {
+        f->i -= len;
+        return 0;
+    }
+    if (f->type == FRAME_MAP || f->type == FRAME_DEF) {
+        if (memcmp(f->a + f->i - len, s, len))
+            return 1;
+    } else {
+        memcpy(f->a + f->i - len, s, len);
     }
+    f->i -= len;
     return 0;
 }
 
-int ungetstr(struct buf *b, char *s)
+int ungetmem(struct input *in, char *s, size_t len)
 {
-    size_t len = strlen(s);
-    while (len)
-        if (ungetch(b, *(s + --len)) == EOF)
-            return 1;
+    /* Pushes a copy of s onto the input, to be read next */
+    struct frame *f;
+    char *old;
+    size_t k;
+    in->pushed += len;
+    if (!len || !unread(in, s, len))
+        return 0;
+    old = in->str->a;
+    if (len > BUF_FREE_SIZE(in->str) && grow_buf(in->str, len))
+        return 1;
+    if (in->str->a != old)
+        for (k = 0; k < in->n; ++k)
+            if ((in->f + k)->type == FRAME_STR)
+                (in->f + k)->a = in->str->a + (in->f + k)->off;
+    if ((f = push_frame(in, FRAME_STR)) == NULL)
+        return 1;
+    f->off = in->str->i;
+    f->a = in->str->a + f->off;
+    memcpy(f->a, s, len);
+    f->s = len;
+    in->str->i += len;
     return 0;
 }
 
-#if ESYSCMD_MAKETEMP
-int esyscmd(struct buf *input, struct buf *tmp_buf, char *cmd)
+int ungetstr(struct input *in, char *s)
+{
+    return ungetmem(in, s, strlen(s));
+}
+
+int unget_num(struct input *in, size_t n)
+{
+    /* Pushes n in decimal onto the input */
+    char num[NUM_SIZE];
+    size_t k = NUM_SIZE;
+    do {
+        *(num + --k) = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    return ungetmem(in, num + k, NUM_SIZE - k);
+}
+
+int push_buf(struct input *in, struct buf **b, size_t off, size_t len)
+{
+    /*
+     * Pushes len bytes of *b, from off, onto the input without copying.
+     * The input takes ownership of the buffer and *b is replaced with an
+     * empty one.
+     */
+    struct frame *f;
+    struct buf *t;
+    if (!len)
+        return 0;
+    in->pushed += len;
+    if ((t = get_spare(in)) == NULL)
+        return 1;
+    if ((f = push_frame(in, FRAME_BUF)) == NULL) {
+        recycle_buf(in, t);
+        return 1;
+    }
+    f->b = *b;
+    f->a = (*b)->a + off;
+    f->s = len;
+    *b = t;
+    return 0;
+}
+
+int push_mem(struct input *in, char *s, size_t len)
+{
+    /*
+     * Pushes s, which was obtained from malloc, onto the input without
+     * copying. The input takes ownership of s, even on error.
+     */
+    struct frame *f;
+    if (!len || (f = push_frame(in, FRAME_MEM)) == NULL) {
+        free(s);
+        return len ? 1 : 0;
+    }
+    f->a = s;
+    f->s = len;
+    in->pushed += len;
+    return 0;
+}
+
+int push_def(struct input *in, struct def *d)
+{
+    /*
+     * Pushes a definition, with the argument positions removed, onto the
+     * input without copying. The frame holds the definition.
+     */
+    struct frame *f;
+    if (!d->strip_len)
+        return 0;
+    if ((f = push_frame(in, FRAME_DEF)) == NULL)
+        return 1;
+    f->a = d->strip;
+    f->s = d->strip_len;
+    f->d = d;
+    ++d->refs;
+    in->pushed += d->strip_len;
+    return 0;
+}
+
+int filesize(char *fn, size_t * fs)
+{
+    /* Gets the filesize of a filename */
+    struct stat st;
+    if (stat(fn, &st))
+        return 1;
+
+#ifndef S_ISREG
+#define S_ISREG(m) ((m & S_IFMT) == S_IFREG)
+#endif
+
+    if (!S_ISREG(st.st_mode))
+        return 1;
+    if (st.st_size < 0)
+        return 1;
+    *fs = st.st_size;
+    return 0;
+}
+
+#ifndef _WIN32
+int map_file(char *fn, size_t size, char **a)
+{
+    /*
+     * Memory maps a file. Returns 1 on error. A failed mapping is not an
+     * error, it just leaves *a as NULL.
+     */
+    int fd;
+    void *m;
+    *a = NULL;
+    if ((fd = open(fn, O_RDONLY)) == -1)
+        return 1;
+    m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (close(fd)) {
+        if (m != MAP_FAILED)
+            munmap(m, size);
+        return 1;
+    }
+    if (m != MAP_FAILED)
+        *a = m;
+    return 0;
+}
+#endif
+
+int include(struct input *in, char *fn)
+{
+    /* Pushes a file onto the input. The file is read forwards. */
+    struct frame *f;
+    size_t size;
+    char *a = NULL;
+    FILE *fp;
+
+    if (filesize(fn, &size))
+        return 1;
+    /* Nothing to read */
+    if (!size)
+        return 0;
+
+#ifndef _WIN32
+    if (map_file(fn, size, &a))
+        return 1;
+    if (a != NULL) {
+        if ((f = push_frame(in, FRAME_MAP)) == NULL) {
+            munmap(a, size);
+            return 1;
+        }
+        f->a = a;
+        f->s = size;
+        return 0;
+    }
+#endif
+
+    /* Fallback to block reading */
+    if ((a = malloc(FILE_BLOCK_SIZE)) == NULL)
+        return 1;
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        free(a);
+        return 1;
+    }
+    if ((f = push_frame(in, FRAME_FILE)) == NULL) {
+        fclose(fp);
+        free(a);
+        return 1;
+    }
+    f->a = a;
+    f->fp = fp;
+    return 0;
+}
+
+int char_class(int c)
+{
+    /* Default class of a char, without the quotes */
+    if (isalpha(c) || c == '_')
+        return TOK_WORD | CC_START | CC_IDENT | CC_QUOTE_PLAIN;
+    if (isdigit(c))
+        return TOK_OTHER | CC_IDENT | CC_PLAIN | CC_ARG_PLAIN
+            | CC_QUOTE_PLAIN;
+    switch (c) {
+    case '(':
+        return TOK_OPEN | CC_PLAIN | CC_QUOTE_PLAIN;
+    case ')':
+        return TOK_CLOSE | CC_PLAIN | CC_QUOTE_PLAIN;
+    case ',':
+        return TOK_COMMA | CC_PLAIN | CC_QUOTE_PLAIN;
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+        return TOK_WS | CC_PLAIN | CC_ARG_PLAIN | CC_QUOTE_PLAIN;
+    }
+    return TOK_OTHER | CC_PLAIN | CC_ARG_PLAIN | CC_QUOTE_PLAIN;
+}
+
+void set_quotes(unsigned char *cc, unsigned char lq, unsigned char rq)
+{
+    /*
+     * Fills the char class table for the quote chars. When a quote char
+     * can be in a word, quoted text cannot be copied through by the char,
+     * as the word must be read to see if it is the quote.
+     */
+    int c, ident;
+    ident = (char_class(lq) | char_class(rq)) & CC_IDENT;
+    for (c = 0; c <= UCHAR_MAX; ++c) {
+        *(cc + c) = char_class(c);
+        if (ident && *(cc + c) & CC_IDENT)
+            *(cc + c) &= ~CC_QUOTE_PLAIN;
+    }
+    *(cc + lq) &= ~(CC_KIND | CC_PLAIN | CC_ARG_PLAIN | CC_QUOTE_PLAIN);
+    *(cc + lq) |= TOK_LQ;
+    *(cc + rq) &= ~(CC_KIND | CC_PLAIN | CC_ARG_PLAIN | CC_QUOTE_PLAIN);
+    *(cc + rq) |= TOK_RQ;
+}
+
+size_t plain_len(char *a, size_t n, unsigned char *cc, int flag,
+                 unsigned char lq, unsigned char rq)
+{
+    /*
+     * Returns the number of chars at the start of a that have flag set in
+     * the char class table, so can be copied straight through. The vector
+     * scan skips blocks of 16 chars that have none of the stop chars, and
+     * the table finds the stop char in the block that does.
+     */
+    size_t k = 0;
+#if defined SCAN_SSE2 || defined SCAN_NEON
+    /* Inside quotes, words must be read when a quote char can be in one */
+    int letters = flag != CC_QUOTE_PLAIN, call = flag == CC_ARG_PLAIN;
+    if (letters || !((*(cc + lq) | *(cc + rq)) & CC_IDENT)) {
+#ifdef SCAN_SSE2
+        __m128i v, m, lo;
+        while (k + 16 <= n) {
+            v = _mm_loadu_si128((__m128i *) (a + k));
+            m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(lq)),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(rq)));
+            if (letters) {
+                /* Lower case, then move a to z to the bottom of the range */
+                lo = _mm_add_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+                                  _mm_set1_epi8((char) (0x80 - 'a')));
+                m = _mm_or_si128(m, _mm_cmplt_epi8(lo,
+                                  _mm_set1_epi8((char) (0x80 + 26))));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+            }
+            if (call) {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+            }
+            if (_mm_movemask_epi8(m))
+                break;
+            k += 16;
+        }
+#else
+        uint8x16_t v, m;
+        while (k + 16 <= n) {
+            v = vld1q_u8((uint8_t *) (a + k));
+            m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(lq)),
+                         vceqq_u8(v, vdupq_n_u8(rq)));
+            if (letters) {
+                m = vorrq_u8(m, vcltq_u8(vsubq_u8(vorrq_u8(v,
+                                 vdupq_n_u8(0x20)), vdupq_n_u8('a')),
+                                 vdupq_n_u8(26)));
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('_')));
+            }
+            if (call) {
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('(')));
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(')')));
+                m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(',')));
+            }
+            if (vmaxvq_u8(m))
+                break;
+            k += 16;
+        }
+#endif
+    }
+#else
+    /* The quote chars are only needed by the vector scan */
+    (void) lq;
+    (void) rq;
+#endif
+    while (k < n && *(cc + (unsigned char) *(a + k)) & flag)
+        ++k;
+    return k;
+}
+
+size_t quoted_len(char *a, size_t n, unsigned char *cc, unsigned char lq,
+                  unsigned char rq, size_t *depth)
+{
+    /*
+     * Returns the number of chars at the start of a that are quoted text,
+     * nested quotes included, updating the quote depth. When the depth
+     * falls to 0, the last char counted is the close quote. Only for quote
+     * chars that cannot be in a word.
+     */
+    size_t k = 0;
+    while ((k += plain_len(a + k, n - k, cc, CC_QUOTE_PLAIN, lq, rq)) < n) {
+        if ((*(cc + (unsigned char) *(a + k++)) & CC_KIND) == TOK_LQ)
+            ++*depth;
+        else if (!--*depth)
+            break;
+    }
+    return k;
+}
+
+int getword(struct token *t, struct input *in, unsigned char *cc, int *err)
+{
+    /*
+     * Reads a token, which is a word or a single char. When the token is
+     * within the top frame no copy is made. Returns 1 at the end of input,
+     * setting *err on error.
+     */
+    struct frame *f = in->top;
+    unsigned char *p, *q, *end;
+    size_t memo_len = 0;
+    int x;
+
+    if (in->profiling)
+        t->prof = frame_prof(in);
+    if (f != NULL && f->i < f->s) {
+        p = (unsigned char *) f->a + f->i;
+        q = p + 1;
+        if (*(cc + *p) & CC_START) {
+            end = (unsigned char *) f->a + f->s;
+            while (q < end && *(cc + *q) & CC_IDENT)
+                ++q;
+            /* The word might continue in the next block or frame */
+            if (q == end) {
+                if (f->memo)
+                    memo_len = q - p;
+                goto slow;
+            }
+        }
+        f->i += q - p;
+        t->a = (char *) p;
+        t->len = q - p;
+        t->kind = TOK_KIND(cc, *p, t->len);
+        return 0;
+    }
+
+  slow:
+    errno = 0;
+    if ((x = getch(in)) == EOF) {
+        if (errno)
+            *err = 1;
+        return 1;
+    }
+    if (!(*(cc + x) & CC_START)) {
+        t->ch = x;
+        t->a = &t->ch;
+        t->len = 1;
+        t->kind = *(cc + x) & CC_KIND;
+        return 0;
+    }
+    delete_buf(t->b);
+    do {
+        if (ungetch(t->b, x) == EOF) {
+            *err = 1;
+            return 1;
+        }
+        errno = 0;
+        if ((x = getch(in)) == EOF) {
+            if (errno) {
+                *err = 1;
+                return 1;
+            }
+            /* The word ends with the input */
+            break;
+        }
+    } while (*(cc + x) & CC_IDENT);
+    if (x != EOF) {
+        /* Read past the end of the word, so put the char back */
+        t->ch = x;
+        if (ungetmem(in, &t->ch, 1)) {
+            *err = 1;
+            return 1;
+        }
+    }
+    t->a = t->b->a;
+    t->len = t->b->i;
+    t->kind = TOK_KIND(cc, (unsigned char) *t->a, t->len);
+    /* The word was all in the memo frame that reading past it popped */
+    if (memo_len && t->len == memo_len && in->memo_popped)
+        in->memo_word = 1;
+    return 0;
+}
+
+int skip_ws(struct input *in, unsigned char *cc)
 {
+    /*
+     * Skips whitespace on the input, moving the read index of the top frame
+     * over it without making tokens. Returns 1 on error.
+     */
+    struct frame *f;
+    int x;
+    char ch;
+    while (1) {
+        if ((f = in->top) != NULL && f->i < f->s) {
+            while (f->i < f->s
+                   && (*(cc + (unsigned char) *(f->a + f->i)) & CC_KIND)
+                   == TOK_WS)
+                ++f->i;
+            if (f->i < f->s)
+                return 0;
+        }
+        /* Refill or pop the frame, or read from stdin */
+        errno = 0;
+        if ((x = getch(in)) == EOF)
+            return errno ? 1 : 0;
+        if ((*(cc + x) & CC_KIND) != TOK_WS) {
+            ch = x;
+            return ungetmem(in, &ch, 1);
+        }
+    }
+}
+
+#if ESYSCMD_MAKETEMP
+/* A command run by esyscmd */
+struct cmd {
+    char *s;
+    struct buf *b;              /* Output */
+#ifdef _WIN32
     FILE *fp;
-    int x, status;
-    delete_buf(tmp_buf);
+#else
+    pid_t pid;
+    int fd;                     /* Read end of the output pipe, or -1 */
+#endif
+};
+
+int read_cmd(struct cmd *c, size_t *got)
+{
+    /*
+     * Reads the next block of output of a command straight into its buffer,
+     * dropping any null bytes. got is 0 at the end of the output.
+     */
+    char *p, *q, *end;
+    size_t n;
+    if (grow_buf(c->b, CMD_BLOCK_SIZE))
+        return 1;
+    p = c->b->a + c->b->i;
+#ifdef _WIN32
+    n = fread(p, 1, BUF_FREE_SIZE(c->b), c->fp);
+    if (!n && ferror(c->fp))
+        return 1;
+#else
+    {
+        ssize_t r;
+        while ((r = read(c->fd, p, BUF_FREE_SIZE(c->b))) == -1
+               && errno == EINTR);
+        if (r == -1)
+            return 1;
+        n = r;
+    }
+#endif
+    *got = n;
+    if ((q = memchr(p, '\0', n)) != NULL) {
+        for (end = p + n, p = q; p < end; ++p)
+            if (*p != '\0')
+                *q++ = *p;
+        n = q - (c->b->a + c->b->i);
+    }
+    c->b->i += n;
+    return 0;
+}
+
+#ifdef _WIN32
+int run_cmds(struct cmd *c, size_t n)
+{
+    /* Runs the commands one after another, as there is no fork */
+    size_t k, got;
+    int ret = 0;
+    for (k = 0; k < n && !ret; ++k) {
+        if (((c + k)->fp = popen((c + k)->s, "rb")) == NULL)
+            return 1;
+        do
+            if (read_cmd(c + k, &got)) {
+                ret = 1;
+                break;
+            }
+        while (got);
+        if (pclose((c + k)->fp))
+            ret = 1;
+    }
+    return ret;
+}
+#else
+int spawn_cmd(struct cmd *c)
+{
+    /*
+     * Starts sh -c with the command, writing to a pipe. posix_spawn does not
+     * copy the page tables of m4, so it stays cheap when m4 is big.
+     */
+    int p[2], e;
+    posix_spawn_file_actions_t fa;
+    char *argv[4];
+    *argv = "sh";
+    *(argv + 1) = "-c";
+    *(argv + 2) = c->s;
+    *(argv + 3) = NULL;
+    if (pipe(p))
+        return 1;
+    /* Commands running at the same time must not hold each other's pipes */
+    if (fcntl(*p, F_SETFD, FD_CLOEXEC) == -1
+        || posix_spawn_file_actions_init(&fa)) {
+        close(*p);
+        close(*(p + 1));
+        return 1;
+    }
+    e = (*(p + 1) != STDOUT_FILENO
+         && (posix_spawn_file_actions_adddup2(&fa, *(p + 1), STDOUT_FILENO)
+             || posix_spawn_file_actions_addclose(&fa, *(p + 1))))
+        || posix_spawn(&c->pid, "/bin/sh", &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(*(p + 1));
+    if (e) {
+        close(*p);
+        return 1;
+    }
+    c->fd = *p;
+    return 0;
+}
+
+int wait_cmd(struct cmd *c)
+{
+    /* Reaps a command, failing unless it exited with 0 */
+    int status;
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    while (waitpid(c->pid, &status, 0) == -1)
+        if (errno != EINTR)
+            return 1;
+    c->pid = 0;
+    return !(WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+int run_cmds(struct cmd *c, size_t n)
+{
+    /*
+     * Runs up to CMD_MAX of the commands at a time, reading whichever have
+     * output ready, so none blocks on a full pipe. A command that fails
+     * stops the rest, which are still reaped.
+     */
+    struct pollfd pf[CMD_MAX];
+    struct cmd *run[CMD_MAX];
+    size_t next = 0, num_run = 0, k, got;
+    int ret = 0;
+    while (!ret && (next < n || num_run)) {
+        while (next < n && num_run < CMD_MAX) {
+            if (spawn_cmd(c + next)) {
+                ret = 1;
+                break;
+            }
+            *(run + num_run++) = c + next++;
+        }
+        if (ret)
+            break;
+        for (k = 0; k < num_run; ++k) {
+            (pf + k)->fd = (*(run + k))->fd;
+            (pf + k)->events = POLLIN;
+            (pf + k)->revents = 0;
+        }
+        if (poll(pf, num_run, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            ret = 1;
+            break;
+        }
+        for (k = num_run; k-- > 0;) {
+            if (!(pf + k)->revents)
+                continue;
+            if (read_cmd(*(run + k), &got)) {
+                ret = 1;
+            } else if (!got) {
+                if (wait_cmd(*(run + k)))
+                    ret = 1;
+                /* The last takes its place, and was looked at already */
+                *(run + k) = *(run + --num_run);
+            }
+        }
+    }
+    for (k = 0; k < num_run; ++k)
+        wait_cmd(*(run + k));
+    return ret;
+}
+#endif
+
+int esyscmd(struct input *input, char *s, size_t n)
+{
+    /*
+     * Runs the n commands at s, which follow each other null terminated,
+     * at the same time. Their output is pushed onto the input in order.
+     */
+    struct cmd *c;
+    size_t k;
+    int ret = 0;
+    if (!n)
+        return 0;
+    if ((c = calloc(n, sizeof(struct cmd))) == NULL)
+        return 1;
+    for (k = 0; k < n; ++k) {
+        (c + k)->s = s;
+        s += strlen(s) + 1;
+#ifndef _WIN32
+        (c + k)->fd = -1;
+#endif
+        if (((c + k)->b = get_spare(input)) == NULL) {
+            ret = 1;
+            goto clean_up;
+        }
+    }
+    if (run_cmds(c, n)) {
+        ret = 1;
+        goto clean_up;
+    }
+    /* The last is pushed first, so that the first is read first */
+    for (k = n; k-- > 0;)
+        if (push_buf(input, &(c + k)->b, 0, (c + k)->b->i)) {
+            ret = 1;
+            goto clean_up;
+        }
+
+  clean_up:
+    for (k = 0; k < n; ++k)
+        if ((c + k)->b != NULL)
+            recycle_buf(input, (c + k)->b);
+    free(c);
+    return ret;
+}
+#endif
+
+#if WORD_HASH
+/* Odd multiplier from the golden ratio, and the shift to fold the product */
+#if SIZE_MAX > 0xFFFFFFFFUL
+#define HASH_MUL ((size_t) 0x9E3779B9UL << 16 << 16 | 0x7F4A7C15UL)
+#define HASH_SHIFT 32
+#else
+#define HASH_MUL ((size_t) 0x9E3779B9UL)
+#define HASH_SHIFT 16
+#endif
+
+/* Mixes word w into hash h */
+#define HASH_MIX(h, w) do { \
+    h = (h ^ w) * HASH_MUL; \
+    h ^= h >> HASH_SHIFT; \
+} while (0)
+
+size_t hash_mem(char *s, size_t len)
+{
+    /*
+     * Multiplicative hash, a word at a time. The last word is zero padded
+     * and the length is mixed in first, so padding does not collide.
+     * Returns the full hash, not reduced to a bucket.
+     */
+    size_t h = len, w;
+    HASH_MIX(h, HASH_MUL);
+    while (len >= sizeof(size_t)) {
+        memcpy(&w, s, sizeof(size_t));
+        HASH_MIX(h, w);
+        s += sizeof(size_t);
+        len -= sizeof(size_t);
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, s, len);
+        HASH_MIX(h, w);
+    }
+    return h;
+}
+#else
+size_t hash_mem(char *s, size_t len)
+{
+    /* djb2. Returns the full hash, not reduced to a bucket. */
+    size_t h = 5381;
+    while (len--)
+        h = h * 33 ^ (unsigned char) *s++;
+    return h;
+}
+#endif
+
+size_t filter_index(char *s, size_t len)
+{
+    /*
+     * Membership filter index of a name. Only the length and the first and
+     * last chars are used, so that the name does not need to be hashed to
+     * find that it is not in the table.
+     */
+    if (!len)
+        return 0;
+    return ((((size_t) (unsigned char) *s << 8)
+             ^ (unsigned char) *(s + len - 1)) * 31 + len)
+        & (FILTER_SIZE - 1);
+}
+
+/* Name cannot be in the hash table */
+#define NOT_IN_TABLE(ht, s, len) (!*(ht->filter + filter_index(s, len)))
+
+#if FLAT_HASH_TABLE
+struct hash_table *init_hash_table(size_t s)
+{
+    /* s must be a power of two */
+    struct hash_table *ht;
+    if ((ht = calloc(1, sizeof(struct hash_table))) == NULL)
+        return NULL;
+    if ((ht->slot = calloc(s, sizeof(struct slot))) == NULL) {
+        free(ht);
+        return NULL;
+    }
+    ht->s = s;
+    return ht;
+}
+
+char *arena_alloc(struct hash_table *ht, size_t size)
+{
+    /* Allocates from the head chunk, starting a new chunk when it is full */
+    struct chunk *c = ht->arena;
+    size_t cs;
+    char *p;
+    /* Keep allocations aligned for struct def */
+    if (AOF(size, sizeof(size_t)))
+        return NULL;
+    size = (size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+    if (c == NULL || size > c->s - c->i) {
+        cs = MAX(ARENA_CHUNK_SIZE, size);
+        if (AOF(cs, sizeof(struct chunk)))
+            return NULL;
+        if ((c = malloc(sizeof(struct chunk) + cs)) == NULL)
+            return NULL;
+        c->i = 0;
+        c->s = cs;
+        c->next = ht->arena;
+        ht->arena = c;
+    }
+    /* The bytes follow the chunk header */
+    p = (char *) (c + 1) + c->i;
+    c->i += size;
+    return p;
+}
+
+struct entry *alloc_entry(struct hash_table *ht)
+{
+    /* Takes an entry from the free list or the head slab */
+    struct entry *e;
+    struct slab *sl;
+    if ((e = ht->free_e) != NULL) {
+        ht->free_e = e->next;
+    } else {
+        if (ht->slab == NULL || ht->slab_i == SLAB_SIZE) {
+            if ((sl = malloc(sizeof(struct slab))) == NULL)
+                return NULL;
+            sl->next = ht->slab;
+            ht->slab = sl;
+            ht->slab_i = 0;
+        }
+        e = ht->slab->e + ht->slab_i++;
+    }
+    e->next = NULL;
+    e->name = NULL;
+    e->len = 0;
+    e->def = NULL;
+    e->bi = BI_NONE;
+    e->hash = 0;
+    e->prof = NULL;
+    e->pure = 0;
+    return e;
+}
+
+struct def *alloc_def(struct hash_table *ht, size_t s)
+{
+    /* Allocates a definition with space for s bytes in the arena */
+    struct def *d;
+    if (AOF(s, sizeof(struct def)))
+        return NULL;
+    if ((d = (struct def *) arena_alloc(ht, sizeof(struct def) + s)) == NULL)
+        return NULL;
+    d->s = s;
+    d->refs = 1;
+    return d;
+}
+
+#else
+struct entry *init_entry(void)
+{
+    struct entry *e;
+    if ((e = malloc(sizeof(struct entry))) == NULL)
+        return NULL;
+    e->next = NULL;
+    e->name = NULL;
+    e->len = 0;
+    e->def = NULL;
+    e->bi = BI_NONE;
+    e->hash = 0;
+    e->prof = NULL;
+    e->pure = 0;
+    return e;
+}
+
+struct def *alloc_def(struct hash_table *ht, size_t s)
+{
+    /* Allocates a definition with space for s bytes */
+    struct def *d;
+    (void) ht;
+    if (AOF(s, sizeof(struct def)))
+        return NULL;
+    if ((d = malloc(sizeof(struct def) + s)) == NULL)
+        return NULL;
+    d->s = s;
+    d->refs = 1;
+    return d;
+}
+
+#endif
+
+size_t arg_ref(char *s, size_t * arg)
+{
+    /*
+     * Returns the length of the argument reference at the start of s, or 0
+     * if there is not one. References are $1 to $9, ${N} for any N, and
+     * $#, $* and $@.
+     */
+    size_t k = 2, n = 0;
+    unsigned char h;
+    if (*s != '$')
+        return 0;
+    h = *(s + 1);
+    if (isdigit(h) && h != '0') {
+        *arg = h - '0';
+        return 2;
+    }
+    switch (h) {
+    case '#':
+        *arg = SEG_NARGS;
+        return 2;
+    case '*':
+        *arg = SEG_STAR;
+        return 2;
+    case '@':
+        *arg = SEG_AT;
+        return 2;
+    case '{':
+        while (isdigit((unsigned char) *(s + k))) {
+            if (MOF(n, 10) || AOF(n * 10, *(s + k) - '0'))
+                return 0;
+            n = n * 10 + *(s + k++) - '0';
+        }
+        if (!n || *(s + k) != '}' || n >= SEG_AT)
+            return 0;
+        *arg = n;
+        return k + 1;
+    }
+    return 0;
+}
+
+size_t compile_def(char *def, struct seg *seg, char *strip,
+                   size_t * strip_len)
+{
+    /*
+     * Splits a definition into literal text and argument segments, and
+     * copies the literal text to strip. In strip $# is 0, as that is the
+     * number of arguments of a call without brackets. Returns the number
+     * of segments. When seg is NULL, nothing is stored and the sizes are
+     * just counted.
+     */
+    char ch;
+    size_t k = 0, n = 0, j = 0, arg, len;
+    int lit = 0;                /* In a literal text segment */
+    while ((ch = *(def + k))) {
+        if ((len = arg_ref(def + k, &arg))) {
+            /* Arg */
+            if (seg != NULL) {
+                (seg + n)->arg = arg;
+                (seg + n)->off = 0;
+                (seg + n)->len = 0;
+            }
+            ++n;
+            lit = 0;
+            k += len;
+            if (arg == SEG_NARGS) {
+                if (seg != NULL)
+                    *(strip + j) = '0';
+                ++j;
+            }
+        } else {
+            if (!lit) {
+                if (seg != NULL) {
+                    (seg + n)->arg = 0;
+                    (seg + n)->off = k;
+                    (seg + n)->len = 0;
+                }
+                ++n;
+                lit = 1;
+            }
+            if (seg != NULL) {
+                ++(seg + n - 1)->len;
+                *(strip + j) = ch;
+            }
+            ++j;
+            ++k;
+        }
+    }
+    if (strip != NULL)
+        *(strip + j) = '\0';
+    *strip_len = j;
+    return n;
+}
+
+int set_def(struct hash_table *ht, struct entry *e, char *def, int redef)
+{
+    /*
+     * Sets and compiles the definition of an entry. The old definition is
+     * overwritten if it is big enough and nothing holds it, otherwise it
+     * is released. On redefinition, space is doubled to limit reallocation
+     * of growing definitions.
+     */
+    struct def *d = e->def;
+    size_t len, num_seg, strip_len, need, s;
+    if (def == NULL) {
+        release_def(e->def);
+        e->def = NULL;
+        return 0;
+    }
+    len = strlen(def) + 1;
+    num_seg = compile_def(def, NULL, NULL, &strip_len);
+    /* Segments, then the definition, then the stripped definition if needed */
+    if (MOF(num_seg, sizeof(struct seg)))
+        return 1;
+    need = num_seg * sizeof(struct seg);
+    if (AOF(need, len))
+        return 1;
+    need += len;
+    if (strip_len != len - 1) {
+        if (AOF(need, strip_len + 1))
+            return 1;
+        need += strip_len + 1;
+    }
+    if (d == NULL || d->refs > 1 || need > d->s) {
+        s = need;
+        if (redef) {
+            if (MOF(s, 2))
+                return 1;
+            s *= 2;
+        }
+        if ((d = alloc_def(ht, s)) == NULL)
+            return 1;
+        release_def(e->def);
+        e->def = d;
+    }
+    d->seg = (struct seg *) (d + 1);
+    d->num_seg = num_seg;
+    d->a = (char *) (d->seg + num_seg);
+    memcpy(d->a, def, len);
+    d->strip = strip_len == len - 1 ? d->a : d->a + len;
+    compile_def(def, d->seg, d->strip, &d->strip_len);
+    return 0;
+}
+
+#if FLAT_HASH_TABLE
+int grow_hash_table(struct hash_table *ht)
+{
+    /* Doubles the number of slots, reinserting using the stored hashes */
+    struct slot *t, *sl;
+    size_t new_s, j, h;
+    if (MOF(ht->s, 2 * sizeof(struct slot)))
+        return 1;
+    new_s = ht->s * 2;
+    if ((t = calloc(new_s, sizeof(struct slot))) == NULL)
+        return 1;
+    for (j = 0; j < ht->s; ++j) {
+        sl = ht->slot + j;
+        if (sl->e != NULL) {
+            h = sl->hash & (new_s - 1);
+            while ((t + h)->e != NULL)
+                h = (h + 1) & (new_s - 1);
+            *(t + h) = *sl;
+        }
+    }
+    free(ht->slot);
+    ht->slot = t;
+    ht->s = new_s;
+    return 0;
+}
+
+struct entry *iter_entry(struct hash_table *ht, size_t * k, struct entry *e)
+{
+    /*
+     * Returns the entry after e, or the first when e is NULL and *k is 0.
+     * *k is the next slot to look at.
+     */
+    (void) e;
+    while (*k < ht->s)
+        if ((e = (ht->slot + (*k)++)->e) != NULL)
+            return e;
+    return NULL;
+}
+
+void htdist(struct hash_table *ht)
+{
+    /* Distribution of probe lengths, which are 1 when in the home slot */
+    struct slot *sl;
+    size_t freq[101] = { 0 }, count, k;
+    for (k = 0; k < ht->s; ++k) {
+        sl = ht->slot + k;
+        if (sl->e != NULL) {
+            count = ((k - sl->hash) & (ht->s - 1)) + 1;
+            count < 100 ? ++*(freq + count) : ++*(freq + 100);
+        }
+    }
+    fprintf(stderr, "probe_length number_of_entries\n");
+    for (k = 0; k < 100; k++)
+        if (*(freq + k))
+            fprintf(stderr, "%lu %lu\n", (unsigned long) k,
+                    (unsigned long) *(freq + k));
+    if (*(freq + 100))
+        fprintf(stderr, ">=100 %lu\n", (unsigned long) *(freq + 100));
+}
+
+void short_name(char *sn, char *name, size_t len)
+{
+    /* Copies the start of name, zero padded. Not null terminated. */
+    size_t k = MIN(len, SHORT_NAME);
+    memcpy(sn, name, k);
+    while (k < SHORT_NAME)
+        *(sn + k++) = '\0';
+}
+
+size_t find_slot(struct hash_table *ht, char *name, size_t len, size_t h)
+{
+    /*
+     * Returns the index of the slot holding name, or of the empty slot
+     * where the probe finished. Names shorter than SHORT_NAME are matched
+     * within the slot, as the zero padding encodes the length.
+     */
+    struct slot *sl;
+    char sn[SHORT_NAME];
+    size_t k = h & (ht->s - 1);
+    short_name(sn, name, len);
+    while ((sl = ht->slot + k)->e != NULL) {
+        if (sl->hash == h && !memcmp(sl->sn, sn, SHORT_NAME)
+            && (len < SHORT_NAME || (sl->e->len == len
+                                     && !memcmp(name + SHORT_NAME,
+                                                sl->e->name + SHORT_NAME,
+                                                len - SHORT_NAME))))
+            break;
+        k = (k + 1) & (ht->s - 1);
+    }
+    return k;
+}
+
+struct entry *lookup_entry(struct hash_table *ht, char *name, size_t len)
+{
+    if (NOT_IN_TABLE(ht, name, len))
+        return NULL;
+    return (ht->slot + find_slot(ht, name, len, hash_mem(name, len)))->e;
+}
+
+int upsert_entry(struct hash_table *ht, char *name, char *def, int bi)
+{
+    /* Built-in macros have a def of NULL and an opcode */
+    struct entry *e;
+    struct slot *sl;
+    size_t len = strlen(name), h = hash_mem(name, len);
+    sl = ht->slot + find_slot(ht, name, len, h);
+    if ((e = sl->e) == NULL) {
+        /* Insert entry: */
+        if ((ht->n + 1) * 100 > ht->s * FLAT_MAX_LOAD) {
+            if (grow_hash_table(ht))
+                return 1;
+            sl = ht->slot + find_slot(ht, name, len, h);
+        }
+        if ((e = alloc_entry(ht)) == NULL)
+            return 1;
+        if ((e->name = arena_alloc(ht, len + 1)) == NULL
+            || set_def(ht, e, def, 0)) {
+            /* Arena space is not returned */
+            e->next = ht->free_e;
+            ht->free_e = e;
+            return 1;
+        }
+        memcpy(e->name, name, len + 1);
+        e->len = len;
+        e->bi = bi;
+        e->hash = h;
+        sl->hash = h;
+        short_name(sl->sn, name, len);
+        sl->e = e;
+        ++ht->n;
+        ++*(ht->filter + filter_index(name, len));
+    } else {
+        /* Update entry: */
+        if (set_def(ht, e, def, 1))
+            return 1;
+        e->bi = bi;
+        e->pure = 0;
+    }
+    return 0;
+}
+
+int delete_entry(struct hash_table *ht, char *name)
+{
+    struct slot *sl;
+    size_t i, j, home, mask = ht->s - 1;
+    size_t len = strlen(name);
+    i = find_slot(ht, name, len, hash_mem(name, len));
+    sl = ht->slot + i;
+    /* Not found */
+    if (sl->e == NULL)
+        return 1;
+    /* Entry goes on the free list, arena space is not returned */
+    release_def(sl->e->def);
+    sl->e->next = ht->free_e;
+    ht->free_e = sl->e;
+    sl->e = NULL;
+    --ht->n;
+    --*(ht->filter + filter_index(name, len));
+    /* Shift later slots in the probe sequence back into the gap */
+    j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if ((ht->slot + j)->e == NULL)
+            break;
+        home = (ht->slot + j)->hash & mask;
+        /* Can move if the home slot of j is not cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            *(ht->slot + i) = *(ht->slot + j);
+            (ht->slot + j)->e = NULL;
+            i = j;
+        }
+    }
+    return 0;
+}
+
+void free_hash_table(struct hash_table *ht)
+{
+    struct chunk *c, *nc;
+    struct slab *sl, *nsl;
+    if (ht != NULL) {
+        for (c = ht->arena; c != NULL; c = nc) {
+            nc = c->next;
+            free(c);
+        }
+        for (sl = ht->slab; sl != NULL; sl = nsl) {
+            nsl = sl->next;
+            free(sl);
+        }
+        free(ht->slot);
+        free(ht);
+    }
+}
+
+#else
+struct hash_table *init_hash_table(size_t s)
+{
+    /* s must be a power of two */
+    struct hash_table *ht;
+    if ((ht = calloc(1, sizeof(struct hash_table))) == NULL)
+        return NULL;
+    if ((ht->b = calloc(s, sizeof(struct entry *))) == NULL) {
+        free(ht);
+        return NULL;
+    }
+    ht->s = s;
+    return ht;
+}
+
+int grow_hash_table(struct hash_table *ht)
+{
+    /*
+     * Doubles the number of buckets. Entries are relinked using their
+     * stored hash, so names are not hashed again.
+     */
+    struct entry **t, *e, *ne;
+    size_t new_s, j, h;
+    if (MOF(ht->s, 2 * sizeof(struct entry *)))
+        return 1;
+    new_s = ht->s * 2;
+    if ((t = calloc(new_s, sizeof(struct entry *))) == NULL)
+        return 1;
+    for (j = 0; j < ht->s; ++j) {
+        e = *(ht->b + j);
+        while (e != NULL) {
+            ne = e->next;
+            h = e->hash & (new_s - 1);
+            e->next = *(t + h);
+            *(t + h) = e;
+            e = ne;
+        }
+    }
+    free(ht->b);
+    ht->b = t;
+    ht->s = new_s;
+    return 0;
+}
+
+struct entry *iter_entry(struct hash_table *ht, size_t * k, struct entry *e)
+{
+    /*
+     * Returns the entry after e, or the first when e is NULL and *k is 0.
+     * *k is the next bucket to look at.
+     */
+    if (e != NULL && e->next != NULL)
+        return e->next;
+    while (*k < ht->s)
+        if ((e = *(ht->b + (*k)++)) != NULL)
+            return e;
+    return NULL;
+}
+
+void htdist(struct hash_table *ht)
+{
+    struct entry *e;
+    size_t freq[101] = { 0 }, count, k;
+    for (k = 0; k < ht->s; ++k) {
+        e = *(ht->b + k);
+        count = 0;
+        while (e != NULL) {
+            e = e->next;
+            ++count;
+        }
+        count < 100 ? ++*(freq + count) : ++*(freq + 100);
+    }
+    fprintf(stderr, "entries_per_bucket number_of_buckets\n");
+    for (k = 0; k < 100; k++)
+        if (*(freq + k))
+            fprintf(stderr, "%lu %lu\n", (unsigned long) k,
+                    (unsigned long) *(freq + k));
+    if (*(freq + 100))
+        fprintf(stderr, ">=100 %lu\n", (unsigned long) *(freq + 100));
+}
+
+struct entry *lookup_entry(struct hash_table *ht, char *name, size_t len)
+{
+    size_t h;
+    struct entry *e;
+    if (NOT_IN_TABLE(ht, name, len))
+        return NULL;
+    h = hash_mem(name, len);
+    e = *(ht->b + (h & (ht->s - 1)));
+    while (e != NULL) {
+        /* Found */
+        if (e->hash == h && e->len == len && !memcmp(name, e->name, len))
+            return e;
+        e = e->next;
+    }
+    /* Not found */
+    return NULL;
+}
+
+int upsert_entry(struct hash_table *ht, char *name, char *def, int bi)
+{
+    /* Built-in macros have a def of NULL and an opcode */
+    struct entry *e;
+    size_t len = strlen(name), h;
+    if ((e = lookup_entry(ht, name, len)) == NULL) {
+        /* Insert entry: */
+        /* Grow first, so that a failed grow leaves the table unchanged */
+        if (ht->n >= ht->s * MAX_LOAD_FACTOR && grow_hash_table(ht))
+            return 1;
+        if ((e = init_entry()) == NULL)
+            return 1;
+        /* Store data */
+        if ((e->name = strdup(name)) == NULL) {
+            free(e);
+            return 1;
+        }
+        if (set_def(ht, e, def, 0)) {
+            free(e->name);
+            free(e);
+            return 1;
+        }
+        e->len = len;
+        e->bi = bi;
+        e->hash = hash_mem(name, len);
+        h = e->hash & (ht->s - 1);
+        /* Link new entry in at head of list (existing head could be NULL) */
+        e->next = *(ht->b + h);
+        *(ht->b + h) = e;
+        ++ht->n;
+        ++*(ht->filter + filter_index(name, len));
+    } else {
+        /* Update entry: */
+        if (set_def(ht, e, def, 1))
+            return 1;
+        e->bi = bi;
+        e->pure = 0;
+    }
+    return 0;
+}
+
+int delete_entry(struct hash_table *ht, char *name)
+{
+    size_t len = strlen(name), h = hash_mem(name, len);
+    struct entry *e = *(ht->b + (h & (ht->s - 1))), *prev = NULL;
+    while (e != NULL) {
+        /* Found */
+        if (e->hash == h && e->len == len && !memcmp(name, e->name, len))
+            break;
+        prev = e;
+        e = e->next;
+    }
+    if (e != NULL) {
+        /* Found */
+        /* Link around the entry */
+        if (prev != NULL)
+            prev->next = e->next;
+        else
+            *(ht->b + (h & (ht->s - 1))) = e->next;
+        free(e->name);
+        release_def(e->def);
+        free(e);
+        --ht->n;
+        --*(ht->filter + filter_index(name, len));
+        return 0;
+    }
+
+    /* Not found */
+    return 1;
+}
+
+void free_hash_table(struct hash_table *ht)
+{
+    struct entry *e, *ne;
+    size_t j;
+    if (ht != NULL) {
+        for (j = 0; j < ht->s; ++j) {
+            e = *(ht->b + j);
+            while (e != NULL) {
+                ne = e->next;
+                free(e->name);
+                release_def(e->def);
+                free(e);
+                e = ne;
+            }
+        }
+        free(ht->b);
+        free(ht);
+    }
+}
+
+#endif
+
+int put_frozen(FILE * fp, void *p, size_t n, size_t * off, int pad)
+{
+    /* Writes n bytes, then pads to FROZEN_ALIGN if pad is set */
+    char z[FROZEN_ALIGN];
+    size_t k;
+    if (fwrite(p, 1, n, fp) != n)
+        return 1;
+    *off += n;
+    if (pad && (k = FROZEN_PAD(*off) - *off)) {
+        memset(z, 0, k);
+        if (fwrite(z, 1, k, fp) != k)
+            return 1;
+        *off += k;
+    }
+    return 0;
+}
+
+int freeze(struct hash_table *ht, unsigned char lq, unsigned char rq,
+           char *fn)
+{
+    /* Writes the hash table and quotes to a frozen file */
+    FILE *fp;
+    struct frozen_head h;
+    struct frozen_entry fe;
+    struct entry *e = NULL;
+    struct def *d;
+    size_t k = 0, off = 0;
+
+    if ((fp = fopen(fn, "wb")) == NULL)
+        return 1;
+    memset(&h, 0, sizeof(struct frozen_head));
+    memcpy(h.magic, FROZEN_MAGIC, sizeof(h.magic));
+    h.check = FROZEN_CHECK;
+    h.num = ht->n;
+    h.lq = lq;
+    h.rq = rq;
+    /* The size is filled in at the end */
+    if (put_frozen(fp, &h, sizeof(struct frozen_head), &off, 1))
+        goto error;
+    while ((e = iter_entry(ht, &k, e)) != NULL) {
+        memset(&fe, 0, sizeof(struct frozen_entry));
+        fe.len = e->len;
+        fe.bi = e->bi;
+        fe.pure = e->pure;
+        if ((d = e->def) != NULL) {
+            fe.has_def = 1;
+            fe.own_strip = d->strip != d->a;
+            fe.num_seg = d->num_seg;
+            fe.def_len = strlen(d->a);
+            fe.strip_len = d->strip_len;
+        }
+        if (put_frozen(fp, &fe, sizeof(struct frozen_entry), &off, 1)
+            || put_frozen(fp, e->name, e->len + 1, &off, 1))
+            goto error;
+        if (d != NULL
+            && (put_frozen(fp, d->seg, d->num_seg * sizeof(struct seg),
+                           &off, 0)
+                || put_frozen(fp, d->a, fe.def_len + 1, &off, !fe.own_strip)
+                || (fe.own_strip
+                    && put_frozen(fp, d->strip, d->strip_len + 1, &off, 1))))
+            goto error;
+    }
+    h.size = off;
+    if (fseek(fp, 0, SEEK_SET)
+        || fwrite(&h, sizeof(struct frozen_head), 1, fp) != 1)
+        goto error;
+    return fclose(fp) == EOF;
+
+  error:
+    fclose(fp);
+    return 1;
+}
+
+int thaw_def(struct hash_table *ht, struct thaw *t, size_t * off,
+             struct frozen_entry *fe, struct def **dp)
+{
+    /*
+     * Makes a definition that points into the frozen file, checking that it
+     * is all in the file. The definition has no space of its own, so it is
+     * not written over when redefined.
+     */
+    struct def *d;
+    struct seg *sg;
+    size_t need, k;
+    if (MOF(fe->num_seg, sizeof(struct seg)))
+        return 1;
+    need = fe->num_seg * sizeof(struct seg);
+    if (AOF(need, fe->def_len + 1))
+        return 1;
+    need += fe->def_len + 1;
+    if (fe->own_strip) {
+        if (AOF(need, fe->strip_len + 1))
+            return 1;
+        need += fe->strip_len + 1;
+    }
+    if (*off > t->s || need > t->s - *off)
+        return 1;
+    sg = (struct seg *) (t->a + *off);
+    for (k = 0; k < fe->num_seg; ++k)
+        if (!(sg + k)->arg && ((sg + k)->off > fe->def_len
+                               || (sg + k)->len >
+                               fe->def_len - (sg + k)->off))
+            return 1;
+    if ((d = alloc_def(ht, 0)) == NULL)
+        return 1;
+    d->seg = sg;
+    d->num_seg = fe->num_seg;
+    d->a = (char *) (sg + fe->num_seg);
+    d->strip = fe->own_strip ? d->a + fe->def_len + 1 : d->a;
+    d->strip_len = fe->own_strip ? fe->strip_len : fe->def_len;
+    if (*(d->a + fe->def_len) != '\0'
+        || *(d->strip + d->strip_len) != '\0') {
+        release_def(d);
+        return 1;
+    }
+    *off += need;
+    *off = FROZEN_PAD(*off);
+    *dp = d;
+    return 0;
+}
+
+int thaw(struct hash_table *ht, char *fn, struct thaw *t,
+         unsigned char *lq, unsigned char *rq)
+{
+    /*
+     * Loads a frozen file into an empty hash table. The file is memory
+     * mapped if possible, otherwise read in, and must be held until the
+     * definitions are freed.
+     */
+    struct frozen_head *h;
+    struct frozen_entry *fe;
+    struct entry *e;
+    struct def *d;
+    char *name;
+    size_t off, k;
+    FILE *fp;
+
+    if (filesize(fn, &t->s) || t->s < sizeof(struct frozen_head))
+        return 1;
+#ifndef _WIN32
+    if (map_file(fn, t->s, &t->a))
+        return 1;
+    t->mapped = t->a != NULL;
+#endif
+    if (t->a == NULL) {
+        if ((t->a = malloc(t->s)) == NULL)
+            return 1;
+        if ((fp = fopen(fn, "rb")) == NULL)
+            return 1;
+        if (fread(t->a, 1, t->s, fp) != t->s) {
+            fclose(fp);
+            return 1;
+        }
+        if (fclose(fp))
+            return 1;
+    }
+
+    h = (struct frozen_head *) t->a;
+    if (memcmp(h->magic, FROZEN_MAGIC, sizeof(h->magic))
+        || h->check != FROZEN_CHECK || h->size != t->s)
+        return 1;
+    *lq = h->lq;
+    *rq = h->rq;
+    off = FROZEN_PAD(sizeof(struct frozen_head));
+    for (k = 0; k < h->num; ++k) {
+        if (off > t->s || t->s - off < sizeof(struct frozen_entry))
+            return 1;
+        fe = (struct frozen_entry *) (t->a + off);
+        off += sizeof(struct frozen_entry);
+        name = t->a + off;
+        if (fe->len >= t->s - off || *(name + fe->len) != '\0'
+            || strlen(name) != fe->len || fe->bi < BI_NONE
+            || fe->bi >= NUM_BI)
+            return 1;
+        off = FROZEN_PAD(off + fe->len + 1);
+        if (upsert_entry(ht, name, NULL, fe->bi))
+            return 1;
+        e = lookup_entry(ht, name, fe->len);
+        e->pure = fe->pure;
+        if (fe->has_def) {
+            if (thaw_def(ht, t, &off, fe, &d))
+                return 1;
+            release_def(e->def);
+            e->def = d;
+        }
+    }
+    return 0;
+}
+
+void free_thaw(struct thaw *t)
+{
+    if (t->a != NULL) {
+#ifndef _WIN32
+        if (t->mapped) {
+            munmap(t->a, t->s);
+            return;
+        }
+#endif
+        free(t->a);
+    }
+}
+
+char *get_def(struct hash_table *ht, char *name)
+{
+    struct entry *e;
+    if ((e = lookup_entry(ht, name, strlen(name))) == NULL)
+        return NULL;
+    return e->def == NULL ? NULL : e->def->a;
+}
+
+void free_mcall(struct mcall *m)
+{
+    if (m != NULL) {
+        release_def(m->def);
+        free_buf(m->args);
+        free(m->arg_off);
+        free(m);
+    }
+}
+
+int next_arg(struct mcall *m)
+{
+    /* Terminates the current argument and moves on to the next one */
+    size_t *t;
+    if (ungetch(m->args, '\0') == EOF)
+        return 1;
+    ++m->act_arg;
+    /* Room for the end offset too */
+    if (m->act_arg + 1 >= m->arg_s) {
+        if (MOF(m->arg_s, 2 * sizeof(size_t)))
+            return 1;
+        if ((t = realloc(m->arg_off, m->arg_s * 2 * sizeof(size_t))) == NULL)
+            return 1;
+        m->arg_off = t;
+        m->arg_s *= 2;
+    }
+    *(m->arg_off + m->act_arg) = m->args->i;
+    return 0;
+}
+
+int terminate_args(struct mcall *m)
+{
+    /* Terminates the last argument and records where it ends */
+    if (ungetch(m->args, '\0') == EOF)
+        return 1;
+    *(m->arg_off + m->act_arg + 1) = m->args->i;
+    return 0;
+}
+
+int stack_on_mcall(struct mcall **stack, struct mcall **pool,
+                   size_t * pool_n, struct stats *st)
+{
+    /*
+     * Takes a frame from the pool if possible. A pooled frame keeps its
+     * argument buffer and offsets.
+     */
+    struct mcall *t;
+    if (*pool != NULL) {
+        t = *pool;
+        *pool = t->next;
+        --*pool_n;
+    } else if ((t = calloc(1, sizeof(struct mcall))) == NULL) {
+        return 1;
+    }
+    /* Link new head on, so that it is freed with the stack on error */
+    t->next = *stack;
+    *stack = t;
+    t->depth = t->next == NULL ? 1 : t->next->depth + 1;
+    if (t->depth > st->depth)
+        st->depth = t->depth;
+    if (t->args == NULL && (t->args = init_buf(st)) == NULL)
+        return 1;
+    if (t->arg_off == NULL) {
+        if ((t->arg_off = malloc(INIT_NUM_ARGS * sizeof(size_t))) == NULL)
+            return 1;
+        t->arg_s = INIT_NUM_ARGS;
+    }
+    t->bi = BI_NONE;
+    t->pure = 0;
+    t->bracket_depth = 0;
+    delete_buf(t->args);
+    /* Arg 0 is not used */
+    t->act_arg = 1;
+    *(t->arg_off + 1) = 0;
+    return 0;
+}
+
+void delete_stack_head(struct mcall **stack, struct mcall **pool,
+                       size_t * pool_n)
+{
+    /*
+     * Returns the head frame to the pool, keeping its argument buffer
+     * unless it is large.
+     */
+    struct mcall *m;
+    if ((m = *stack) == NULL)
+        return;
+    *stack = m->next;
+    if (*pool_n == MCALL_POOL_MAX) {
+        free_mcall(m);
+        return;
+    }
+    release_def(m->def);
+    m->def = NULL;
+    if (m->args != NULL && m->args->s > SPARE_MAX_SIZE) {
+        free_buf(m->args);
+        m->args = NULL;
+    }
+    m->next = *pool;
+    *pool = m;
+    ++*pool_n;
+}
+
+void free_stack(struct mcall *stack)
+{
+    struct mcall *m = stack, *next;
+    while (m != NULL) {
+        next = m->next;
+        free_mcall(m);
+        m = next;
+    }
+}
+
+int put_mem(struct buf *b, char *s, size_t len)
+{
+    if (len > BUF_FREE_SIZE(b) && grow_buf(b, len))
+        return 1;
+    memcpy(b->a + b->i, s, len);
+    b->i += len;
+    return 0;
+}
+
+int put_str(struct buf *b, char *s)
+{
+    return put_mem(b, s, strlen(s));
+}
+
+int sub_args(struct buf *result, struct mcall *stack, char lq, char rq)
+{
+    /*
+     * Expands the compiled definition, so the result is sized up front.
+     * $* is all of the arguments separated by commas, and $@ is the same
+     * with each argument quoted.
+     */
+    struct def *d = stack->def;
+    struct seg *g;
+    char *args = stack->args->a, *r, num[NUM_SIZE];
+    size_t *off = stack->arg_off, n = stack->act_arg, k, j, len, total = 0;
+    delete_buf(result);
+    for (k = 0; k < d->num_seg; ++k) {
+        g = d->seg + k;
+        if (!g->arg)
+            len = g->len;
+        else if (g->arg == SEG_NARGS)
+            len = NUM_SIZE;
+        else if (g->arg == SEG_STAR)
+            len = *(off + n + 1);
+        else if (g->arg == SEG_AT)
+            len = *(off + n + 1) + 2 * n;
+        else if (g->arg <= n)
+            len = *(off + g->arg + 1) - *(off + g->arg) - 1;
+        else
+            len = 0;
+        if (AOF(total, len))
+            return 1;
+        total += len;
+    }
+    if (total > BUF_FREE_SIZE(result) && grow_buf(result, total))
+        return 1;
+    r = result->a;
+    for (k = 0; k < d->num_seg; ++k) {
+        g = d->seg + k;
+        if (!g->arg) {
+            memcpy(r, d->a + g->off, g->len);
+            r += g->len;
+        } else if (g->arg == SEG_NARGS) {
+            j = NUM_SIZE;
+            len = n;
+            do {
+                *(num + --j) = '0' + len % 10;
+                len /= 10;
+            } while (len);
+            memcpy(r, num + j, NUM_SIZE - j);
+            r += NUM_SIZE - j;
+        } else if (g->arg == SEG_STAR || g->arg == SEG_AT) {
+            for (j = 1; j <= n; ++j) {
+                if (j > 1)
+                    *r++ = ',';
+                if (g->arg == SEG_AT)
+                    *r++ = lq;
+                len = *(off + j + 1) - *(off + j) - 1;
+                memcpy(r, args + *(off + j), len);
+                r += len;
+                if (g->arg == SEG_AT)
+                    *r++ = rq;
+            }
+        } else if (g->arg <= n) {
+            len = *(off + g->arg + 1) - *(off + g->arg) - 1;
+            memcpy(r, args + *(off + g->arg), len);
+            r += len;
+        }
+    }
+    result->i = r - result->a;
+    return 0;
+}
+
+int str_to_num(char *s, size_t * num)
+{
+    char ch;
+    size_t n = 0, len = 0;
+    if (s == NULL)
+        return 1;
+    while ((ch = *s++)) {
+        ++len;
+        if (isdigit(ch)) {
+            if (MOF(n, 10))
+                return 1;
+            n *= 10;
+            if (AOF(n, (ch - '0')))
+                return 1;
+            n += (ch - '0');
+        } else {
+            return 1;
+        }
+    }
+    if (!len)
+        return 1;
+    *num = n;
+    return 0;
+}
+
+/* Expression being read by eval */
+struct eval {
+    char *p;                    /* Next character */
+    size_t depth;               /* Nesting */
+    int err;                    /* First error, after which the rest unwinds */
+};
+
+int64_t eval_cond(struct eval *ev, int live);
+
+void eval_space(struct eval *ev)
+{
+    while (isspace((unsigned char) *ev->p))
+        ++ev->p;
+}
+
+int64_t eval_num(struct eval *ev)
+{
+    /*
+     * Reads a number in decimal, or hexadecimal after 0x or binary after 0b.
+     * Any 64 bit pattern can be written, so 0xffffffffffffffff is -1.
+     */
+    unsigned char *s = (unsigned char *) ev->p, *start;
+    uint64_t n = 0, base = 10, d;
+    if (*s == '0' && (*(s + 1) == 'x' || *(s + 1) == 'X')) {
+        base = 16;
+        s += 2;
+    } else if (*s == '0' && (*(s + 1) == 'b' || *(s + 1) == 'B')) {
+        base = 2;
+        s += 2;
+    }
+    start = s;
+    while (isalnum(*s)) {
+        d = isdigit(*s) ? *s - '0' : tolower(*s) - 'a' + 10;
+        if (d >= base) {
+            ev->err = EVAL_SYNTAX;
+            return 0;
+        }
+        if (n > (UINT64_MAX - d) / base) {
+            ev->err = EVAL_RANGE;
+            return 0;
+        }
+        n = n * base + d;
+        ++s;
+    }
+    if (s == start) {
+        ev->err = EVAL_SYNTAX;
+        return 0;
+    }
+    ev->p = (char *) s;
+    return (int64_t) n;
+}
+
+int64_t eval_unary(struct eval *ev, int live)
+{
+    int64_t x = 0;
+    if (++ev->depth > EVAL_DEPTH) {
+        ev->err = EVAL_RANGE;
+        return 0;
+    }
+    eval_space(ev);
+    switch (*ev->p) {
+    case '-':
+        ++ev->p;
+        x = (int64_t) (0 - (uint64_t) eval_unary(ev, live));
+        break;
+    case '+':
+        ++ev->p;
+        x = eval_unary(ev, live);
+        break;
+    case '~':
+        ++ev->p;
+        x = ~eval_unary(ev, live);
+        break;
+    case '!':
+        ++ev->p;
+        x = !eval_unary(ev, live);
+        break;
+    case '(':
+        ++ev->p;
+        x = eval_cond(ev, live);
+        eval_space(ev);
+        if (*ev->p == ')')
+            ++ev->p;
+        else if (!ev->err)
+            ev->err = EVAL_SYNTAX;
+        break;
+    default:
+        x = eval_num(ev);
+    }
+    --ev->depth;
+    return x;
+}
+
+int eval_op(char *s, int *op, int *len)
+{
+    /*
+     * Returns the precedence of the binary operator at s, as in C with
+     * ** above the multiplicative operators, or 0 when there is none.
+     */
+    char c = *s, c2 = *(s + 1);
+    *op = c;
+    *len = 1;
+#define OP2(o) do { \
+    *op = o; \
+    *len = 2; \
+} while (0)
+    switch (c) {
+    case '|':
+        if (c2 == '|') {
+            OP2(EV_LOR);
+            return 1;
+        }
+        return 3;
+    case '&':
+        if (c2 == '&') {
+            OP2(EV_LAND);
+            return 2;
+        }
+        return 5;
+    case '^':
+        return 4;
+    case '=':
+        if (c2 == '=') {
+            OP2(EV_EQ);
+            return 6;
+        }
+        return 0;
+    case '!':
+        if (c2 == '=') {
+            OP2(EV_NE);
+            return 6;
+        }
+        return 0;
+    case '<':
+        if (c2 == '<') {
+            OP2(EV_SHL);
+            return 8;
+        }
+        if (c2 == '=')
+            OP2(EV_LE);
+        return 7;
+    case '>':
+        if (c2 == '>') {
+            OP2(EV_SHR);
+            return 8;
+        }
+        if (c2 == '=')
+            OP2(EV_GE);
+        return 7;
+    case '+':
+    case '-':
+        return 9;
+    case '*':
+        if (c2 == '*') {
+            OP2(EV_POW);
+            return 11;
+        }
+        return 10;
+    case '/':
+    case '%':
+        return 10;
+    }
+#undef OP2
+    return 0;
+}
+
+int64_t eval_apply(struct eval *ev, int op, int64_t x, int64_t y, int live)
+{
+    /*
+     * Applies a binary operator. Arithmetic wraps around in 64 bits, so it
+     * is done unsigned. Errors only count where the operands are used, so
+     * 0 && 1 / 0 is fine.
+     */
+    uint64_t ux = (uint64_t) x, uy = (uint64_t) y, r;
+    switch (op) {
+    case EV_LOR:
+        return x || y;
+    case EV_LAND:
+        return x && y;
+    case '|':
+        return x | y;
+    case '^':
+        return x ^ y;
+    case '&':
+        return x & y;
+    case EV_EQ:
+        return x == y;
+    case EV_NE:
+        return x != y;
+    case '<':
+        return x < y;
+    case EV_LE:
+        return x <= y;
+    case '>':
+        return x > y;
+    case EV_GE:
+        return x >= y;
+    case EV_SHL:
+        return (int64_t) (ux << (uy & 63));
+    case EV_SHR:
+        /* Arithmetic shift, without relying on >> of a negative */
+        return x < 0 ? ~(int64_t) (~ux >> (uy & 63))
+            : (int64_t) (ux >> (uy & 63));
+    case '+':
+        return (int64_t) (ux + uy);
+    case '-':
+        return (int64_t) (ux - uy);
+    case '*':
+        return (int64_t) (ux * uy);
+    case '/':
+    case '%':
+        if (!y) {
+            if (live)
+                ev->err = EVAL_DIV_ZERO;
+            return 0;
+        }
+        /* The most negative number divided by -1 wraps around */
+        if (y == -1)
+            return op == '/' ? (int64_t) (0 - ux) : 0;
+        return op == '/' ? x / y : x % y;
+    case EV_POW:
+        if (y < 0) {
+            if (live)
+                ev->err = EVAL_NEG_EXP;
+            return 0;
+        }
+        for (r = 1; uy; uy >>= 1) {
+            if (uy & 1)
+                r *= ux;
+            ux *= ux;
+        }
+        return (int64_t) r;
+    }
+    return 0;
+}
+
+int64_t eval_bin(struct eval *ev, int prec, int live)
+{
+    /* Reads operators of at least prec, by precedence climbing */
+    int64_t x, y;
+    int p, op, len;
+    if (++ev->depth > EVAL_DEPTH) {
+        ev->err = EVAL_RANGE;
+        return 0;
+    }
+    x = eval_unary(ev, live);
+    while (!ev->err) {
+        eval_space(ev);
+        if ((p = eval_op(ev->p, &op, &len)) < prec || !p)
+            break;
+        ev->p += len;
+        /* Only ** groups to the right */
+        y = eval_bin(ev, op == EV_POW ? p : p + 1, op == EV_LAND ? live && x
+            : op == EV_LOR ? live && !x : live);
+        x = eval_apply(ev, op, x, y, live);
+    }
+    --ev->depth;
+    return x;
+}
+
+int64_t eval_cond(struct eval *ev, int live)
+{
+    /* Reads a ? b : c, or the expression without it */
+    int64_t x, y, z;
+    if (++ev->depth > EVAL_DEPTH) {
+        ev->err = EVAL_RANGE;
+        return 0;
+    }
+    x = eval_bin(ev, 1, live);
+    eval_space(ev);
+    if (!ev->err && *ev->p == '?') {
+        ++ev->p;
+        y = eval_cond(ev, live && x);
+        eval_space(ev);
+        if (*ev->p == ':') {
+            ++ev->p;
+            z = eval_cond(ev, live && !x);
+            x = x ? y : z;
+        } else {
+            if (!ev->err)
+                ev->err = EVAL_SYNTAX;
+            x = 0;
+        }
+    }
+    --ev->depth;
+    return x;
+}
+
+int eval_str(char *s, int64_t *res)
+{
+    /* Evaluates the expression s, returning the first error */
+    struct eval ev;
+    ev.p = s;
+    ev.depth = 0;
+    ev.err = 0;
+    *res = eval_cond(&ev, 1);
+    eval_space(&ev);
+    if (!ev.err && *ev.p != '\0')
+        ev.err = EVAL_SYNTAX;
+    return ev.err;
+}
+
+int unget_snum(struct input *in, int64_t x, size_t radix, size_t width)
+{
+    /* Pushes x in the radix, from 2 to 36, with at least width digits */
+    char num[EVAL_NUM_SIZE];
+    size_t k = EVAL_NUM_SIZE;
+    uint64_t n = x < 0 ? 0 - (uint64_t) x : (uint64_t) x;
+    do {
+        *(num + --k) = "0123456789abcdefghijklmnopqrstuvwxyz"[n % radix];
+        n /= radix;
+    } while (n);
+    while (EVAL_NUM_SIZE - k < width)
+        *(num + --k) = '0';
+    if (x < 0)
+        *(num + --k) = '-';
+    return ungetmem(in, num + k, EVAL_NUM_SIZE - k);
+}
+
+char *find_mem(char *h, size_t hl, char *n, size_t nl)
+{
+    /*
+     * Returns the first occurrence of n in h, or NULL. Long strings use
+     * Horspool's algorithm, which skips ahead by the last byte of the
+     * window and so usually reads only a fraction of h.
+     */
+    size_t skip[UCHAR_MAX + 1], k, last;
+    unsigned char *p, *end;
+    if (!nl)
+        return h;
+    if (nl > hl)
+        return NULL;
+    if (nl == 1)
+        return memchr(h, *n, hl);
+    if (hl < SEARCH_MIN || nl < SEARCH_NEEDLE_MIN) {
+        end = (unsigned char *) h + hl - nl;
+        for (p = (unsigned char *) h; p <= end; ++p) {
+            if ((p = memchr(p, *n, end - p + 1)) == NULL)
+                return NULL;
+            if (!memcmp(p + 1, n + 1, nl - 1))
+                return (char *) p;
+        }
+        return NULL;
+    }
+    last = nl - 1;
+    for (k = 0; k <= UCHAR_MAX; ++k)
+        *(skip + k) = nl;
+    for (k = 0; k < last; ++k)
+        *(skip + (unsigned char) *(n + k)) = last - k;
+    end = (unsigned char *) h + hl - nl;
+    for (p = (unsigned char *) h; p <= end; p += *(skip + *(p + last)))
+        if (*(p + last) == (unsigned char) *(n + last)
+            && !memcmp(p, n, last))
+            return (char *) p;
+    return NULL;
+}
+
+void tr_compile(struct tr_map *t, char *from, size_t from_len, char *to,
+                size_t to_len)
+{
+    /*
+     * Bytes of from map to the byte at the same place in to, or are dropped
+     * past the end of to. The first occurrence of a byte in from is used.
+     */
+    unsigned char seen[UCHAR_MAX + 1], c;
+    size_t k;
+    for (k = 0; k <= UCHAR_MAX; ++k) {
+        *(t->map + k) = (unsigned char) k;
+        *(t->keep + k) = 1;
+        *(seen + k) = 0;
+    }
+    t->del = 0;
+    for (k = 0; k < from_len; ++k) {
+        c = *(from + k);
+        if (*(seen + c))
+            continue;
+        *(seen + c) = 1;
+        if (k < to_len) {
+            *(t->map + c) = *(to + k);
+        } else {
+            *(t->keep + c) = 0;
+            t->del = 1;
+        }
+    }
+}
+
+struct tr_map *tr_get(struct tr_map *tr, char *from, size_t from_len,
+                      char *to, size_t to_len)
+{
+    /*
+     * Returns the compiled map for from and to, from the cache when it was
+     * used before. Keys that are too long, or cannot be stored, are compiled
+     * every time.
+     */
+    struct tr_map *t;
+    size_t len = from_len + to_len;
+    t = tr + ((hash_mem(from, from_len) * 31 + hash_mem(to, to_len))
+              & (TR_SIZE - 1));
+    if (t->key != NULL && t->from_len == from_len && t->to_len == to_len
+        && !memcmp(t->key, from, from_len)
+        && !memcmp(t->key + from_len, to, to_len))
+        return t;
+    free(t->key);
+    t->key = NULL;
+    tr_compile(t, from, from_len, to, to_len);
+    if (len <= TR_KEY_MAX && (t->key = malloc(len + 1)) != NULL) {
+        memcpy(t->key, from, from_len);
+        memcpy(t->key + from_len, to, to_len);
+        t->from_len = from_len;
+        t->to_len = to_len;
+    }
+    return t;
+}
+
+size_t tr_apply(struct tr_map *t, char *a, size_t len)
+{
+    /*
+     * Translates a in place and returns the new length. Without dropped
+     * bytes this is a straight table lookup. Otherwise every byte is
+     * written and only the kept ones advance, so there is no branch on the
+     * data.
+     */
+    unsigned char *p = (unsigned char *) a, *q = p, *end = p + len;
+    unsigned char *map = t->map, *keep = t->keep, c;
+    if (!t->del) {
+        for (; end - p >= 4; p += 4) {
+            *p = *(map + *p);
+            *(p + 1) = *(map + *(p + 1));
+            *(p + 2) = *(map + *(p + 2));
+            *(p + 3) = *(map + *(p + 3));
+        }
+        for (; p < end; ++p)
+            *p = *(map + *p);
+        return len;
+    }
+    for (; p < end; ++p) {
+        c = *p;
+        *q = *(map + c);
+        q += *(keep + c);
+    }
+    return q - (unsigned char *) a;
+}
+
+void free_tr(struct tr_map *tr)
+{
+    size_t k;
+    for (k = 0; k < TR_SIZE; ++k)
+        free((tr + k)->key);
+}
+
+int buf_dump_buf(struct buf *dst, struct buf *src)
+{
+    if (src->i > BUF_FREE_SIZE(dst) && grow_buf(dst, src->i))
+        return 1;
+    memcpy(dst->a + dst->i, src->a, src->i);
+    dst->i += src->i;
+    src->i = 0;
+    return 0;
+}
+
+void free_chain(struct buf *b)
+{
+    struct buf *t;
+    while (b != NULL) {
+        t = b->next;
+        free_buf(b);
+        b = t;
+    }
+}
 
-#ifdef _WIN32
-#define R_STR "rb"
-#else
-#define R_STR "r"
-#endif
-    if ((fp = popen(cmd, R_STR)) == NULL)
+int spill_div(struct div *d)
+{
+    /* Moves the text of a diversion from memory to its spill file */
+    struct buf *t;
+    if (!d->len && !d->b->i)
+        return 0;
+    if (d->fp == NULL && (d->fp = tmpfile()) == NULL)
+        return 1;
+    while ((t = d->first) != NULL) {
+        if (fwrite(t->a, 1, t->i, d->fp) != t->i)
+            return 1;
+        d->first = t->next;
+        free_buf(t);
+    }
+    d->last = NULL;
+    d->len = 0;
+    if (fwrite(d->b->a, 1, d->b->i, d->fp) != d->b->i)
         return 1;
+    d->b->i = 0;
+    return 0;
+}
 
-    errno = 0;
-    while ((x = getc(fp)) != EOF)
-        if (x != '\0' && ungetch(tmp_buf, x) == EOF) {
-            pclose(fp);
+int copy_file(FILE *src, FILE *dst)
+{
+    /* Copies all of src to the end of dst */
+    char *a;
+    size_t n;
+    if (fflush(src) || fseek(src, 0L, SEEK_SET))
+        return 1;
+    if ((a = malloc(FILE_BLOCK_SIZE)) == NULL)
+        return 1;
+    while ((n = fread(a, 1, FILE_BLOCK_SIZE, src))) {
+        if (fwrite(a, 1, n, dst) != n) {
+            free(a);
             return 1;
         }
-    if (errno) {
-        pclose(fp);
-        return 1;
     }
-    if ((status = pclose(fp)) == -1)
-        return 1;
-#ifdef _WIN32
-    if (status)
+    free(a);
+    return ferror(src) ? 1 : 0;
+}
+
+int send_file(FILE *src, FILE *out)
+{
+    /*
+     * Copies all of src to out. On Linux the kernel copies the file
+     * directly, without passing it through user space.
+     */
+#ifdef __linux__
+    struct stat st;
+    off_t off = 0;
+    ssize_t r;
+    /* Streams without a file descriptor, such as memory streams */
+    if (fileno(out) == -1)
+        return copy_file(src, out);
+    if (fflush(src) || fflush(out) || fstat(fileno(src), &st))
         return 1;
+    while (off < st.st_size) {
+        if ((r = sendfile(fileno(out), fileno(src), &off,
+                          st.st_size - off)) == -1) {
+            /* Not supported for this output, so copy instead */
+            if (!off && (errno == EINVAL || errno == ENOSYS))
+                return copy_file(src, out);
+            return 1;
+        }
+        if (!r)
+            return 1;
+    }
+    return 0;
 #else
-#define EXIT_OK (WIFEXITED(status) && !WEXITSTATUS(status))
-    if (!EXIT_OK)
+    return copy_file(src, out);
+#endif
+}
+
+int write_chain(struct div *d, FILE *out)
+{
+    /*
+     * Writes the chain of a diversion to out, several buffers a call when
+     * out has a file descriptor.
+     */
+    struct buf *t;
+#ifndef _WIN32
+    struct iovec iov[IOV_NUM];
+    int n, fd = fileno(out);
+    ssize_t r;
+    if (fd != -1 && d->first != NULL && fflush(out))
         return 1;
+    while (fd != -1 && d->first != NULL) {
+        for (n = 0, t = d->first; n < IOV_NUM && t != NULL; ++n, t = t->next) {
+            (iov + n)->iov_base = t->a;
+            (iov + n)->iov_len = t->i;
+        }
+        if ((r = writev(fd, iov, n)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        /* Release what was written, keeping the rest of a partial write */
+        while ((t = d->first) != NULL && (size_t) r >= t->i) {
+            r -= t->i;
+            d->len -= t->i;
+            d->first = t->next;
+            free_buf(t);
+        }
+        if (r) {
+            memmove(t->a, t->a + r, t->i - r);
+            t->i -= r;
+            d->len -= r;
+        }
+    }
 #endif
-    if (ungetch(tmp_buf, '\0') == EOF)
+    while ((t = d->first) != NULL) {
+        if (fwrite(t->a, 1, t->i, out) != t->i)
+            return 1;
+        d->len -= t->i;
+        d->first = t->next;
+        free_buf(t);
+    }
+    d->last = NULL;
+    return 0;
+}
+
+int out_div(struct div *d, FILE *out)
+{
+    /* Writes a diversion to out and empties it */
+    if (d->fp != NULL) {
+        if (send_file(d->fp, out))
+            return 1;
+        if (fclose(d->fp)) {
+            d->fp = NULL;
+            return 1;
+        }
+        d->fp = NULL;
+    }
+    if (write_chain(d, out))
         return 1;
-    if (ungetstr(input, tmp_buf->a))
+    if (d->b->i && fwrite(d->b->a, 1, d->b->i, out) != d->b->i)
         return 1;
+    d->b->i = 0;
     return 0;
 }
-#endif
 
-struct entry *init_entry(void)
+void chain_buf(struct div *d, struct buf *b)
 {
-    struct entry *e;
-    if ((e = malloc(sizeof(struct entry))) == NULL)
-        return NULL;
-    e->next = NULL;
-    e->name = NULL;
-    e->def = NULL;
-    return e;
+    /* Adds a buffer to the end of the chain of a diversion */
+    b->next = NULL;
+    if (d->last != NULL)
+        d->last->next = b;
+    else
+        d->first = b;
+    d->last = b;
+    d->len += b->i;
 }
 
-size_t hash_str(char *s)
+int empty_div(struct div *d)
 {
-    /* djb2 */
-    unsigned char c;
-    size_t h = 5381;
-    while ((c = *s++))
-        h = h * 33 ^ c;
-    return h % HASH_TABLE_SIZE;
+    /* Discards the text of a diversion */
+    free_chain(d->first);
+    d->first = d->last = NULL;
+    d->len = 0;
+    d->b->i = 0;
+    if (d->fp != NULL) {
+        if (fclose(d->fp)) {
+            d->fp = NULL;
+            return 1;
+        }
+        d->fp = NULL;
+    }
+    return 0;
 }
 
-void htdist(struct entry **ht)
+struct div *init_div(size_t num, struct stats *st)
 {
-    struct entry *e;
-    size_t freq[101] = { 0 }, count, k;
-    for (k = 0; k < HASH_TABLE_SIZE; ++k) {
-        e = *(ht + k);
-        count = 0;
-        while (e != NULL) {
-            e = e->next;
-            ++count;
-        }
-        count < 100 ? ++*(freq + count) : ++*(freq + 100);
+    struct div *d;
+    if ((d = malloc(sizeof(struct div))) == NULL)
+        return NULL;
+    if ((d->b = init_buf(st)) == NULL) {
+        free(d);
+        return NULL;
     }
-    fprintf(stderr, "entries_per_bucket number_of_buckets\n");
-    for (k = 0; k < 100; k++)
-        if (*(freq + k))
-            fprintf(stderr, "%lu %lu\n", (unsigned long) k,
-                    (unsigned long) *(freq + k));
-    if (*(freq + 100))
-        fprintf(stderr, ">=100 %lu\n", (unsigned long) *(freq + 100));
+    d->first = d->last = NULL;
+    d->len = 0;
+    d->fp = NULL;
+    d->num = num;
+    return d;
 }
 
-struct entry *lookup_entry(struct entry **ht, char *name)
+int free_div(struct div *d)
 {
-    size_t h = hash_str(name);
-    struct entry *e = *(ht + h);
-    while (e != NULL) {
-        /* Found */
-        if (!strcmp(name, e->name))
-            return e;
-        e = e->next;
+    int ret = 0;
+    if (d != NULL) {
+        free_buf(d->b);
+        free_chain(d->first);
+        if (d->fp != NULL && fclose(d->fp))
+            ret = 1;
+        free(d);
     }
-    /* Not found */
-    return NULL;
+    return ret;
 }
 
-char *get_def(struct entry **ht, char *name)
+size_t div_index(struct div_list *dl, size_t num)
 {
-    struct entry *e;
-    if ((e = lookup_entry(ht, name)) == NULL)
+    /* Returns the index of diversion num, or where it would be inserted */
+    size_t lo = 0, hi = dl->n, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((*(dl->d + mid))->num < num)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+struct div *find_div(struct div_list *dl, size_t num)
+{
+    /* Returns diversion num, or NULL if it has not been used */
+    size_t k = div_index(dl, num);
+    return k < dl->n && (*(dl->d + k))->num == num ? *(dl->d + k) : NULL;
+}
+
+struct div *get_div(struct div_list *dl, size_t num)
+{
+    /* Returns diversion num, making it when first used */
+    struct div **t, *d;
+    size_t k = div_index(dl, num);
+    if (k < dl->n && (*(dl->d + k))->num == num)
+        return *(dl->d + k);
+    if (dl->n == dl->s) {
+        if (MOF(dl->s, 2 * sizeof(struct div *)))
+            return NULL;
+        if ((t = realloc(dl->d, dl->s * 2 * sizeof(struct div *))) == NULL)
+            return NULL;
+        dl->d = t;
+        dl->s *= 2;
+    }
+    if ((d = init_div(num, dl->st)) == NULL)
         return NULL;
-    return e->def;
+    memmove(dl->d + k + 1, dl->d + k, (dl->n - k) * sizeof(struct div *));
+    *(dl->d + k) = d;
+    ++dl->n;
+    return d;
 }
 
-int upsert_entry(struct entry **ht, char *name, char *def)
+int init_divs(struct div_list *dl, struct stats *st)
 {
-    struct entry *e;
-    size_t h;
-    char *t = NULL;
-    if ((e = lookup_entry(ht, name)) == NULL) {
-        /* Insert entry: */
-        if ((e = init_entry()) == NULL)
+    if ((dl->d = malloc(INIT_NUM_DIVS * sizeof(struct div *))) == NULL)
+        return 1;
+    dl->s = INIT_NUM_DIVS;
+    dl->st = st;
+    return get_div(dl, 0) == NULL;
+}
+
+int free_divs(struct div_list *dl)
+{
+    int ret = 0;
+    size_t k;
+    for (k = 0; k < dl->n; ++k)
+        if (free_div(*(dl->d + k)))
+            ret = 1;
+    free(dl->d);
+    if (free_div(dl->discard))
+        ret = 1;
+    return ret;
+}
+
+int dump_div(struct div *dst, struct div *src)
+{
+    /*
+     * Appends src to dst and empties src. Large text is moved by linking
+     * the buffers of src onto the chain of dst, without copying.
+     */
+    struct buf *t, *u;
+    if (src->fp != NULL) {
+        /* The text of dst goes first, so it is moved to the file too */
+        if (dst->fp == NULL && (dst->fp = tmpfile()) == NULL)
             return 1;
-        /* Store data */
-        if ((e->name = strdup(name)) == NULL) {
-            free(e);
+        if (spill_div(dst) || copy_file(src->fp, dst->fp))
             return 1;
-        }
-        if (def != NULL && (e->def = strdup(def)) == NULL) {
-            free(e->name);
-            free(e);
+        if (fclose(src->fp)) {
+            src->fp = NULL;
             return 1;
         }
-        h = hash_str(name);
-        /* Link new entry in at head of list (existing head could be NULL) */
-        e->next = *(ht + h);
-        *(ht + h) = e;
-    } else {
-        /* Update entry: */
-        if (def != NULL && (t = strdup(def)) == NULL)
+        src->fp = NULL;
+    }
+    /* Small text is copied */
+    if (!src->len && src->b->i < MOVE_MIN)
+        return buf_dump_buf(dst->b, src->b);
+    /* Fresh buffers for src and dst, before anything is moved */
+    if ((t = init_buf(src->b->st)) == NULL)
+        return 1;
+    if (dst->b->i) {
+        if ((u = init_buf(dst->b->st)) == NULL) {
+            free_buf(t);
             return 1;
-        free(e->def);
-        e->def = t;             /* Could be NULL */
+        }
+        chain_buf(dst, dst->b);
+        dst->b = u;
+    }
+    if (src->first != NULL) {
+        if (dst->last != NULL)
+            dst->last->next = src->first;
+        else
+            dst->first = src->first;
+        dst->last = src->last;
+        dst->len += src->len;
+        src->first = src->last = NULL;
+        src->len = 0;
     }
+    chain_buf(dst, src->b);
+    src->b = t;
     return 0;
 }
 
-int delete_entry(struct entry **ht, char *name)
+struct prof *get_prof(struct prof **profs, struct entry *e)
 {
-    size_t h = hash_str(name);
-    struct entry *e = *(ht + h), *prev = NULL;
-    while (e != NULL) {
-        /* Found */
-        if (!strcmp(name, e->name))
-            break;
-        prev = e;
-        e = e->next;
-    }
-    if (e != NULL) {
-        /* Found */
-        /* Link around the entry */
-        if (prev != NULL)
-            prev->next = e->next;
-        free(e->name);
-        free(e->def);
-        free(e);
-        /* At head of list */
-        if (prev == NULL)
-            *(ht + h) = NULL;
-        return 0;
+    /* Gets the profile of a macro, adding it to the list on first use */
+    struct prof *p;
+    if (e->prof != NULL)
+        return e->prof;
+    if ((p = calloc(1, sizeof(struct prof))) == NULL)
+        return NULL;
+    if ((p->name = strdup(e->name)) == NULL) {
+        free(p);
+        return NULL;
     }
-
-    /* Not found */
-    return 1;
+    p->next = *profs;
+    *profs = p;
+    e->prof = p;
+    return p;
 }
 
-void free_hash_table(struct entry **ht)
+void prof_end(struct input *in, struct prof *p, clock_t start,
+              size_t pushed, size_t pushes)
 {
-    struct entry *e, *ne;
-    size_t j;
-    if (ht != NULL) {
-        for (j = 0; j < HASH_TABLE_SIZE; ++j) {
-            e = *(ht + j);
-            while (e != NULL) {
-                ne = e->next;
-                free(e->name);
-                free(e->def);
-                free(e);
-                e = ne;
-            }
+    /*
+     * Finishes profiling the processing of a macro call. A frame pushed by
+     * the call is marked, so that reading it is charged to the macro too.
+     */
+    clock_t t = clock() - start;
+    size_t k = in->n;
+    p->pushed += in->pushed - pushed;
+    if (!p->depth)
+        p->incl += t;
+    p->excl += t;
+    while (k--)
+        if ((in->f + k)->prof != NULL) {
+            (in->f + k)->child_time += t;
+            break;
         }
-        free(ht);
+    if (in->pushes != pushes && in->top != NULL && in->top->prof == NULL) {
+        in->top->prof = p;
+        in->top->start = clock();
+        ++p->depth;
     }
 }
 
-void free_mcall(struct mcall *m)
+int prof_cmp(const void *a, const void *b)
 {
-    size_t j = 1;
-    if (m != NULL) {
-        free(m->name);
-        free(m->def);
-        while (*(m->arg_buf + j) != NULL && j < 10) {
-            free_buf(*(m->arg_buf + j));
-            ++j;
-        }
-        free(m);
+    /* Most exclusive time first */
+    clock_t x = (*(struct prof **) a)->excl, y = (*(struct prof **) b)->excl;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int prof_dump(struct prof *profs)
+{
+    /* Prints the profiles to stderr, one macro per line */
+    struct prof *p, **a;
+    size_t n = 0, k;
+    for (p = profs; p != NULL; p = p->next)
+        ++n;
+    if ((a = malloc((n ? n : 1) * sizeof(struct prof *))) == NULL)
+        return 1;
+    for (k = 0, p = profs; p != NULL; p = p->next)
+        *(a + k++) = p;
+    qsort(a, n, sizeof(struct prof *), prof_cmp);
+    fprintf(stderr, "name calls pushed_bytes emitted_bytes"
+            " inclusive_seconds exclusive_seconds\n");
+    for (k = 0; k < n; ++k) {
+        p = *(a + k);
+        fprintf(stderr, "%s %lu %lu %lu %.6f %.6f\n", p->name,
+                (unsigned long) p->calls, (unsigned long) p->pushed,
+                (unsigned long) p->emitted,
+                (double) p->incl / CLOCKS_PER_SEC,
+                (double) p->excl / CLOCKS_PER_SEC);
     }
+    free(a);
+    return 0;
 }
 
-struct mcall *init_mcall(void)
+void free_profs(struct prof *p)
 {
-    struct mcall *m;
-    if ((m = calloc(1, sizeof(struct mcall))) == NULL)
-        return NULL;
-    /*
-     * Arg 0 is not used. Only allocate the buffer for arg 1.
-     * The others will be allocated on demand.
-     */
-    if ((*(m->arg_buf + 1) = init_buf()) == NULL) {
-        free_mcall(m);
-        return NULL;
+    struct prof *t;
+    while (p != NULL) {
+        t = p->next;
+        free(p->name);
+        free(p);
+        p = t;
     }
-    m->act_arg = 1;
-    return m;
 }
 
-int stack_on_mcall(struct mcall **stack)
+void stats_dump(struct m4 *m)
 {
-    struct mcall *t;
-    if ((t = init_mcall()) == NULL)
-        return 1;
+    /* Prints the stats to stderr, one per line */
+    struct stats *st = &m->st;
+    size_t token_s = MAX(m->token.b->s, m->next_token.b->s);
+    fprintf(stderr, "tokens %lu\n", (unsigned long) st->tokens);
+    fprintf(stderr, "calls %lu\n", (unsigned long) st->calls);
+    fprintf(stderr, "buffers_allocated %lu\n", (unsigned long) st->bufs);
+    fprintf(stderr, "buffer_grows %lu\n", (unsigned long) st->grows);
+    fprintf(stderr, "input_frames_peak %lu\n", (unsigned long) st->frames);
+    fprintf(stderr, "input_string_stack_bytes %lu\n",
+            (unsigned long) m->input->str->s);
+    fprintf(stderr, "input_pushed_bytes %lu\n",
+            (unsigned long) m->input->pushed);
+    fprintf(stderr, "token_bytes %lu\n", (unsigned long) token_s);
+    fprintf(stderr, "result_bytes_peak %lu\n", (unsigned long) st->result);
+    fprintf(stderr, "args_bytes_peak %lu\n", (unsigned long) st->args);
+    fprintf(stderr, "diversion_bytes_peak %lu\n", (unsigned long) st->div);
+    fprintf(stderr, "call_depth_peak %lu\n", (unsigned long) st->depth);
+    fprintf(stderr, "entries %lu\n", (unsigned long) m->ht->n);
+    fprintf(stderr, "memo_hits %lu\n", (unsigned long) st->memo_hits);
+    fprintf(stderr, "memo_misses %lu\n", (unsigned long) st->memo_misses);
+}
+
+#define QUIT do { \
+    ret = 1; \
+    goto clean_up; \
+} while (0)
 
-    /* Link new head on */
-    if (*stack != NULL)
-        t->next = *stack;
+/* Arguments of a terminated macro call, as one key */
+#define MEMO_KEY(m) ((m)->args->a + *((m)->arg_off + 1))
+#define MEMO_KEY_LEN(m) (*((m)->arg_off + (m)->act_arg + 1) \
+    - *((m)->arg_off + 1))
 
-    *stack = t;
-    return 0;
+size_t memo_index(struct def *d, char *key, size_t len)
+{
+    return (hash_mem(key, len) ^ (size_t) d / sizeof(struct def))
+        & (MEMO_SIZE - 1);
 }
 
-void delete_stack_head(struct mcall **stack)
+struct memo_slot *memo_get(struct memo *mc, struct mcall *m)
 {
-    struct mcall *m;
-    if (*stack == NULL)
-        return;
-    m = (*stack)->next;
-    free_mcall(*stack);
-    *stack = m;
+    /* Returns the cached expansion of a pure macro call, or NULL */
+    struct memo_slot *sl;
+    char *key = MEMO_KEY(m);
+    size_t len = MEMO_KEY_LEN(m);
+    sl = mc->slot + memo_index(m->def, key, len);
+    if (sl->gen == mc->gen && sl->def == m->def && sl->key_len == len
+        && !memcmp(sl->key, key, len))
+        return sl;
+    return NULL;
 }
 
-void free_stack(struct mcall *stack)
+int memo_fuses(struct memo_slot *sl, struct input *in, unsigned char *cc,
+               int *fuse)
 {
-    struct mcall *m = stack, *next;
-    while (m != NULL) {
-        next = m->next;
-        free_mcall(m);
-        m = next;
-    }
+    /*
+     * Sets fuse when a cached expansion ends in a word that the next char
+     * would continue, as rescanning the expansion would read them as one
+     * word. The cached text is output directly, so cannot be used then.
+     */
+    int x;
+    char ch;
+    *fuse = 0;
+    if (!sl->out_len
+        || !(*(cc + (unsigned char) *(sl->out + sl->out_len - 1)) & CC_IDENT))
+        return 0;
+    errno = 0;
+    if ((x = getch(in)) == EOF)
+        return errno ? 1 : 0;
+    *fuse = *(cc + x) & CC_IDENT ? 1 : 0;
+    ch = x;
+    return ungetmem(in, &ch, 1);
 }
 
-int put_str(struct buf *b, char *s)
+int memo_start(struct memo *mc, struct input *in, struct mcall *m)
 {
-    size_t len = strlen(s);
-    if (len > BUF_FREE_SIZE(b) && grow_buf(b, len))
+    /* Starts recording a pure macro call, unless the key is too big */
+    size_t len = MEMO_KEY_LEN(m);
+    if (len > MEMO_MAX)
+        return 0;
+    if ((mc->rec.key = malloc(len ? len : 1)) == NULL)
         return 1;
-    memcpy(b->a + b->i, s, len);
-    b->i += len;
+    memcpy(mc->rec.key, MEMO_KEY(m), len);
+    mc->rec.key_len = len;
+    mc->rec.gen = mc->gen;
+    mc->rec.def = m->def;
+    mc->out = NULL;
+    mc->on = 1;
+    in->memo_popped = 0;
+    in->memo_word = 0;
     return 0;
 }
 
-int sub_args(struct buf *result, struct mcall *stack)
+void memo_stop(struct memo *mc, struct input *in)
 {
-    char *s = stack->def, ch, h;
-    struct buf *b;
-    delete_buf(result);
-    while ((ch = *s++)) {
-        if (ch == '$') {
-            /* Look ahead */
-            h = *s;
-            if (isdigit(h) && h != '0') {
-                /* Arg */
-                if ((b = *(stack->arg_buf + (h - '0'))) != NULL) {
-                    if (b->i > BUF_FREE_SIZE(result)
-                        && grow_buf(result, b->i))
-                        return 1;
-                    memcpy(result->a + result->i, b->a, b->i);
-                    result->i += b->i;
-                }
-                ++s;            /* Eat */
-            } else {
-                if (ungetch(result, ch) == EOF)
-                    return 1;
-            }
-        } else {
-            if (ungetch(result, ch) == EOF)
-                return 1;
+    /* Stops recording, untagging the frame */
+    size_t k;
+    free(mc->rec.key);
+    mc->rec.key = NULL;
+    mc->on = 0;
+    for (k = 0; k < in->n; ++k)
+        (in->f + k)->memo = 0;
+    in->memo_popped = 0;
+    in->memo_word = 0;
+}
+
+int memo_end(struct memo *mc, struct input *in, char *out, size_t len)
+{
+    /* Stores the recorded expansion, replacing what was in its slot */
+    struct memo_slot *sl;
+    char *t;
+    if (mc->rec.gen == mc->gen && len <= MEMO_MAX) {
+        if ((t = malloc(len ? len : 1)) == NULL) {
+            memo_stop(mc, in);
+            return 1;
         }
+        memcpy(t, out, len);
+        sl = mc->slot + memo_index(mc->rec.def, mc->rec.key, mc->rec.key_len);
+        free(sl->key);
+        free(sl->out);
+        *sl = mc->rec;
+        sl->out = t;
+        sl->out_len = len;
+        /*
+         * Recorded outside of arguments, brackets and commas were plain
+         * text, but would split or close the arguments of a call
+         */
+        sl->args_ok = mc->stack != NULL || (memchr(t, '(', len) == NULL
+            && memchr(t, ')', len) == NULL && memchr(t, ',', len) == NULL);
+        mc->rec.key = NULL;
     }
-    if (ungetch(result, '\0') == EOF)
-        return 1;
-
+    memo_stop(mc, in);
     return 0;
 }
 
-char *strip_def(char *def)
+void free_memo(struct memo *mc)
+{
+    size_t k;
+    free(mc->rec.key);
+    for (k = 0; k < MEMO_SIZE; ++k) {
+        free((mc->slot + k)->key);
+        free((mc->slot + k)->out);
+    }
+}
+
+int free_m4(struct m4 *m)
+{
+    int ret = 0;
+    if (m == NULL)
+        return 0;
+    free_input(m->input);
+    free_buf(m->token.b);
+    free_buf(m->next_token.b);
+    free_buf(m->result);
+    if (m->divs.d != NULL && free_divs(&m->divs))
+        ret = 1;
+    /* Before the hash table, as macro calls can hold definitions */
+    free_stack(m->stack);
+    free_stack(m->pool);
+    free_hash_table(m->ht);
+    /* After the hash table, as loaded definitions point into the file */
+    free_thaw(&m->frz);
+    free_profs(m->profs);
+    free_memo(&m->memo);
+    free_tr(m->tr);
+    free(m);
+    return ret;
+}
+
+struct m4 *init_m4(char *frozen)
 {
-    char *d, *t, ch, h;
-    if ((d = strdup(def)) == NULL)
+    /*
+     * Makes a processor with the built-in macros, or with the definitions
+     * and quotes of a frozen file if one is given. Returns NULL on error.
+     */
+    struct m4 *m;
+    int j;
+
+    if ((m = calloc(1, sizeof(struct m4))) == NULL)
         return NULL;
-    t = d;
-    while ((ch = *def++)) {
-        if (ch == '$') {
-            /* Look ahead */
-            h = *def;
-            if (isdigit(h) && h != '0')
-                ++def;          /* Eat */
-            else
-                *t++ = ch;
-        } else {
-            *t++ = ch;
+    m->lq = '`';
+    m->rq = '\'';
+    m->interactive = 1;
+    m->out_threshold = OUT_THRESHOLD;
+    m->div_budget = DIV_BUDGET;
+    m->memo.gen = 1;
+
+    /* Setup buffers */
+    if ((m->input = init_input(&m->st)) == NULL)
+        goto error;
+    if ((m->token.b = init_buf(&m->st)) == NULL)
+        goto error;
+    if ((m->next_token.b = init_buf(&m->st)) == NULL)
+        goto error;
+    if ((m->result = init_buf(&m->st)) == NULL)
+        goto error;
+
+    /* Setup diversions */
+    if (init_divs(&m->divs, &m->st))
+        goto error;
+    m->act = *m->divs.d;
+
+    if ((m->ht = init_hash_table(HASH_TABLE_SIZE)) == NULL)
+        goto error;
+
+    if (frozen != NULL) {
+        /* The frozen file has the built-in macros that are still defined */
+        if (thaw(m->ht, frozen, &m->frz, &m->lq, &m->rq))
+            goto error;
+    } else {
+        /* Define built-in macros. They have a def of NULL. */
+        for (j = 1; j < NUM_BI; ++j) {
+#if !ESYSCMD_MAKETEMP
+            if (j == BI_ESYSCMD || j == BI_MAKETEMP)
+                continue;
+#endif
+            if (upsert_entry(m->ht, *(bi_name + j), NULL, j))
+                goto error;
         }
     }
-    *t = '\0';
-    return d;
+    set_quotes(m->cc, m->lq, m->rq);
+    return m;
+
+  error:
+    free_m4(m);
+    return NULL;
 }
 
-int terminate_args(struct mcall *stack)
+int batch_output(struct m4 *m, size_t threshold)
 {
-    size_t j = 1;
-    while (*(stack->arg_buf + j) != NULL && j < 10) {
-        if (ungetch(*(stack->arg_buf + j), '\0'))
+    /*
+     * Writes diversion 0 in batches of threshold bytes, instead of after
+     * every token. Diversion 0 is sized so that a batch is written in one
+     * go. Only the size is rounded to OUT_ALIGN, the address is not
+     * aligned.
+     */
+    struct buf *b = (*m->divs.d)->b;
+    size_t s;
+    char *t;
+    if (AOF(threshold, OUT_ALIGN))
+        return 1;
+    s = (threshold + OUT_ALIGN) / OUT_ALIGN * OUT_ALIGN;
+    if (s > b->s) {
+        if ((t = realloc(b->a, s)) == NULL)
             return 1;
-        ++j;
+        b->a = t;
+        b->s = s;
     }
+    m->interactive = 0;
+    m->out_threshold = threshold;
     return 0;
 }
 
-int str_to_num(char *s, size_t * num)
+int feed_file(struct m4 *m, char *fn)
 {
-    char ch;
-    size_t n = 0, len = 0;
-    if (s == NULL)
-        return 1;
-    while ((ch = *s++)) {
-        ++len;
-        if (isdigit(ch)) {
-            if (MOF(n, 10))
-                return 1;
-            n *= 10;
-            if (AOF(n, (ch - '0')))
-                return 1;
-            n += (ch - '0');
-        } else {
-            return 1;
-        }
-    }
-    if (!len)
-        return 1;
-    *num = n;
-    return 0;
+    /* Adds a file to the input. The input added last is read first. */
+    return include(m->input, fn);
 }
 
-int buf_dump_buf(struct buf *dst, struct buf *src)
+int feed_mem(struct m4 *m, char *a, size_t len)
 {
-    if (src->i > BUF_FREE_SIZE(dst) && grow_buf(dst, src->i))
-        return 1;
-    memcpy(dst->a + dst->i, src->a, src->i);
-    dst->i += src->i;
-    src->i = 0;
-    return 0;
+    /* Adds a copy of len bytes of a to the input */
+    return ungetmem(m->input, a, len);
 }
 
-#define QUIT do { \
-    ret = 1; \
-    goto clean_up; \
-} while (0)
+void reset_m4(struct m4 *m)
+{
+    /*
+     * Discards the input, macro calls and diversions left by an error, so
+     * that the processor can be used again. The definitions are kept.
+     */
+    size_t k;
+    while (m->input->top != NULL)
+        pop_frame(m->input);
+    while (m->stack != NULL)
+        delete_stack_head(&m->stack, &m->pool, &m->pool_n);
+    m->quote_on = 0;
+    m->quote_depth = 0;
+    if (m->memo.on)
+        memo_stop(&m->memo, m->input);
+    m->act = *m->divs.d;
+    for (k = 0; k < m->divs.n; ++k)
+        empty_div(*(m->divs.d + k));
+    if (m->divs.discard != NULL)
+        empty_div(m->divs.discard);
+}
 
-int main(int argc, char **argv)
+int expand(struct m4 *m, FILE *out)
 {
-    int ret = 0, read_stdin = 1, err, j;
+    /*
+     * Reads all of the input and writes the output to out, including the
+     * diversions once the input has finished. On error the processor is
+     * reset.
+     */
+    int ret = 0, err;
+    int interactive = m->interactive, profiling = m->profiling;
 #if ESYSCMD_MAKETEMP && !defined _WIN32
     int fd;
 #endif
-    struct buf *input = NULL, *token = NULL, *next_token = NULL, *result =
-        NULL, *tmp_buf = NULL;
-    struct entry **ht = NULL, *e;
-    int quote_on = 0;
-    size_t quote_depth = 0, fs, total_fs = 0, act_div = 0, k, len, w, n;
-    /* Diversion 10 is -1 */
-    struct buf *diversion[11] = { NULL };
+    struct input *input = m->input;
+    struct token token, next_token;
+    struct buf *result = m->result;
+    struct hash_table *ht = m->ht;
+    struct entry *e;
+    struct frame *f;
+    int quote_on = m->quote_on;
+    size_t quote_depth = m->quote_depth, k, len, w, n;
+    size_t out_threshold = m->out_threshold, div_budget = m->div_budget;
+    size_t pool_n = m->pool_n;
+    struct div_list divs;
+    struct div *act = m->act, *d;
     struct buf *output;
-    char left_quote[2] = { '`', '\0' };
-    char right_quote[2] = { '\'', '\0' };
-    struct mcall *stack = NULL;
-#define NUM_SIZE 24
-    char *sd = NULL, *tmp_str = NULL, num[NUM_SIZE], *p, *q;
-    unsigned char uc, uc2;
-    int map[UCHAR_MAX], x;
-
-    if (argc < 1)
-        return 1;
-
-#ifdef _WIN32
-    if (_setmode(_fileno(stdin), _O_BINARY) == -1)
-        return 1;
-    if (_setmode(_fileno(stdout), _O_BINARY) == -1)
-        return 1;
-    if (_setmode(_fileno(stderr), _O_BINARY) == -1)
-        return 1;
-#endif
-
-    /* Setup buffers */
-    if ((input = init_buf()) == NULL)
-        QUIT;
-    if ((token = init_buf()) == NULL)
-        QUIT;
-    if ((next_token = init_buf()) == NULL)
-        QUIT;
-    if ((result = init_buf()) == NULL)
-        QUIT;
-    if ((tmp_buf = init_buf()) == NULL)
-        QUIT;
-
-    /* Setup diversions */
-    for (k = 0; k < 11; ++k)
-        if ((*(diversion + k) = init_buf()) == NULL)
-            QUIT;
-    output = *diversion;
+    unsigned char *cc = m->cc;
+    unsigned char lq = m->lq, rq = m->rq;
+    struct mcall *stack = m->stack, *pool = m->pool;
+    struct prof *profs = m->profs, *cur_prof = NULL, *pr;
+    clock_t prof_start = 0;
+    size_t prof_pushed = 0, prof_pushes = 0;
+    struct stats *st = &m->st;
+    struct memo *mc = &m->memo;
+    struct memo_slot *hit = NULL;
+    char *p;
+    int64_t val;
 
-    if ((ht = calloc(HASH_TABLE_SIZE, sizeof(struct entry *))) == NULL)
-        QUIT;
-
-    /* Define built-in macros. They have a def of NULL. */
-    if (upsert_entry(ht, "define", NULL))
-        QUIT;
-    if (upsert_entry(ht, "undefine", NULL))
-        QUIT;
-    if (upsert_entry(ht, "changequote", NULL))
-        QUIT;
-    if (upsert_entry(ht, "divert", NULL))
-        QUIT;
-    if (upsert_entry(ht, "dumpdef", NULL))
-        QUIT;
-    if (upsert_entry(ht, "errprint", NULL))
-        QUIT;
-    if (upsert_entry(ht, "ifdef", NULL))
-        QUIT;
-    if (upsert_entry(ht, "ifelse", NULL))
-        QUIT;
-    if (upsert_entry(ht, "include", NULL))
-        QUIT;
-    if (upsert_entry(ht, "len", NULL))
-        QUIT;
-    if (upsert_entry(ht, "index", NULL))
-        QUIT;
-    if (upsert_entry(ht, "translit", NULL))
-        QUIT;
-    if (upsert_entry(ht, "substr", NULL))
-        QUIT;
-    if (upsert_entry(ht, "dnl", NULL))
-        QUIT;
-    if (upsert_entry(ht, "divnum", NULL))
-        QUIT;
-    if (upsert_entry(ht, "undivert", NULL))
-        QUIT;
-#if ESYSCMD_MAKETEMP
-    if (upsert_entry(ht, "esyscmd", NULL))
-        QUIT;
-    if (upsert_entry(ht, "maketemp", NULL))
-        QUIT;
-#endif
-    if (upsert_entry(ht, "incr", NULL))
-        QUIT;
-    if (upsert_entry(ht, "htdist", NULL))
-        QUIT;
-    if (upsert_entry(ht, "dirsep", NULL))
-        QUIT;
-    if (upsert_entry(ht, "add", NULL))
-        QUIT;
-    if (upsert_entry(ht, "mult", NULL))
-        QUIT;
-    if (upsert_entry(ht, "sub", NULL))
-        QUIT;
-    if (upsert_entry(ht, "div", NULL))
-        QUIT;
-    if (upsert_entry(ht, "mod", NULL))
-        QUIT;
-
-    if (argc > 1) {
-        /* Do not read stdin if there are command line files */
-        read_stdin = 0;
-        /* Get total size of command line files */
-        for (j = argc - 1; j; --j) {
-            if (filesize(*(argv + j), &fs))
-                QUIT;
-            total_fs += fs;
-        }
-        /* Make sure buffer is big enough to hold all files */
-        if (grow_buf(input, total_fs))
-            QUIT;
-        /* Load command line files into buffer */
-        for (j = argc - 1; j; --j)
-            if (include(input, *(argv + j)))
-                QUIT;
-    }
+    token = m->token;
+    next_token = m->next_token;
+    divs = m->divs;
+    input->profiling = profiling;
+    output = stack == NULL ? act->b : stack->args;
 
-/* Token string */
-#define TS token->a
+/* Token string, length and kind. The string is not null terminated. */
+#define TS token.a
+#define TL token.len
+#define TK token.kind
 
-/* Next token string */
-#define NTS next_token->a
+/* Next token */
+#define NTS next_token.a
+#define NTL next_token.len
+#define NTK next_token.kind
 
 /* End of argument collection */
 #define ARG_END (stack != NULL && stack->bracket_depth == 1 \
-    && !strcmp(TS, ")"))
+    && TK == TOK_CLOSE)
 
 /* Nested close bracket (unquoted) */
 #define NESTED_CB (stack != NULL && stack->bracket_depth > 1 \
-    && !strcmp(TS, ")"))
+    && TK == TOK_CLOSE)
 
 /* Nested open bracket (unquoted) */
-#define NESTED_OB (stack != NULL && !strcmp(TS, "("))
+#define NESTED_OB (stack != NULL && TK == TOK_OPEN)
 
 /* Argument comma in a macro call */
 #define ARG_COMMA (stack != NULL && stack->bracket_depth == 1 \
-    && !strcmp(TS, ","))
+    && TK == TOK_COMMA)
 
-/* String s is a match of a macro name */
-#define ISMACRO(s) ((isalpha(*s) || *s == '_') \
-    && (e = lookup_entry(ht, s)) != NULL)
+/* String s of length len is a match of a macro name */
+#define ISMACRO(s, len) ((isalpha(*s) || *s == '_') \
+    && (e = lookup_entry(ht, s, len)) != NULL)
 
 /* Set output to stack argument collection buffer or diversion buffer */
-#define SET_OUTPUT output = (stack == NULL ? *(diversion + act_div) \
-    : *(stack->arg_buf + stack->act_arg))
+#define SET_OUTPUT output = (stack == NULL ? act->b : stack->args)
 
-#define DIV(n) (*(diversion + n))
+/* Diversion 0 */
+#define DIV0 (*divs.d)
 
-#define OUT_DIV(n) do { \
-    if (DIV(n)->i && fwrite(DIV(n)->a, 1, DIV(n)->i, stdout) != DIV(n)->i) \
+#define STATS_DUMP stats_dump(m)
+
+/* Writing out the text of a pure macro being recorded stops the recording */
+#define OUT_DIV(d) do { \
+    if (mc->on && (d)->b == mc->out) \
+        memo_stop(mc, input); \
+    if (out_div(d, out)) \
         QUIT; \
-    DIV(n)->i = 0; \
 } while (0)
 
-#define UNDIVERT_ALL for (k = 0; k < 10; k++) \
-    OUT_DIV(k)
+/* So does switching diversions, as the text would land elsewhere */
+#define MEMO_DIVERT do { \
+    if (mc->on && mc->out != NULL) \
+        memo_stop(mc, input); \
+} while (0)
+
+/*
+ * And so do the commas and brackets of the call that the text is being
+ * collected into, as a cached copy would skip splitting the arguments
+ */
+#define MEMO_DELIM do { \
+    if (mc->on && mc->out != NULL && stack == mc->stack) \
+        memo_stop(mc, input); \
+} while (0)
+
+/*
+ * A recorded pure macro expansion is done once its frame has drained, so
+ * long as nothing else has changed. This is checked before a token is read,
+ * as that pops the frame, except for a word that ended the frame exactly.
+ */
+#define MEMO_CHECK do { \
+    if (mc->on && mc->out != NULL) { \
+        f = input->top; \
+        if (input->memo_popped && !input->memo_word) { \
+            memo_stop(mc, input); \
+        } else if (input->memo_popped || (f != NULL && f->memo \
+            && f->i == f->s && f->type != FRAME_FILE)) { \
+            if (stack == mc->stack && act == mc->act && output == mc->out \
+                && !quote_depth && output->i >= mc->off) { \
+                if (memo_end(mc, input, output->a + mc->off, \
+                    output->i - mc->off)) \
+                    QUIT; \
+            } else { \
+                memo_stop(mc, input); \
+            } \
+        } \
+    } \
+} while (0)
 
-/* Tests if a string consists of a single whitespace character */
-#define WS(s) (!strcmp(s, " ") || !strcmp(s, "\t") || !strcmp(s, "\n") \
-    || !strcmp(s, "\r"))
+/* Output the diversions in order */
+#define UNDIVERT_ALL for (k = 0; k < divs.n; k++) \
+    OUT_DIV(*(divs.d + k))
 
 /* Remove stack head and set ouput */
 #define REMOVE_SH do { \
-    delete_stack_head(&stack); \
+    delete_stack_head(&stack, &pool, &pool_n); \
     SET_OUTPUT; \
 } while (0)
 
-/* Stack macro collected argument number n */
-#define ARG(n) (*(stack->arg_buf + n) == NULL ? "" : (*(stack->arg_buf + n))->a)
+/* Stack macro collected argument number n, once terminated */
+#define ARG(n) (n > stack->act_arg ? "" \
+    : stack->args->a + *(stack->arg_off + n))
+
+/* Length of stack macro collected argument number n, once terminated */
+#define ARG_LEN(n) (n > stack->act_arg ? 0 \
+    : *(stack->arg_off + n + 1) - *(stack->arg_off + n) - 1)
+
+/*
+ * Push stack macro collected argument number n onto the input, no copy.
+ * The argument buffer goes to the input, so no other argument can be used
+ * after this.
+ */
+#define UNGET_ARG(n) do { \
+    if (n <= stack->act_arg && push_buf(input, &stack->args, \
+        *(stack->arg_off + n), ARG_LEN(n))) \
+        QUIT; \
+} while (0)
 
 #define READ_TOKEN(t) do { \
     err = 0; \
-    if (getword(t, input, read_stdin, &err)) { \
+    if (getword(&t, input, cc, &err)) { \
         if (err) \
             QUIT; \
         else \
@@ -844,10 +4078,7 @@ int main(int argc, char **argv)
 
 /* Eat whitespace */
 #define EAT_WS do { \
-    do \
-        READ_TOKEN(next_token); \
-    while (WS(NTS)); \
-    if (ungetstr(input, NTS)) \
+    if (skip_ws(input, cc)) \
         QUIT; \
 } while (0)
 
@@ -855,19 +4086,42 @@ int main(int argc, char **argv)
 #define DNL do { \
     do \
         READ_TOKEN(next_token); \
-    while (strcmp(NTS, "\n")); \
+    while (NTK != TOK_WS || *NTS != '\n'); \
 } while (0)
 
 #define DIVNUM do { \
-    if (act_div == 10) \
-        snprintf(num, NUM_SIZE, "%d", -1); \
-    else \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) act_div); \
-    if (ungetstr(input, num)) \
+    if (unget_num(input, act->num) \
+        || (act == divs.discard && ungetmem(input, "-", 1))) \
+        QUIT; \
+} while (0)
+
+/*
+ * Output, charging text that is not an argument to the profile p of the
+ * expansion it was read from
+ */
+#define EMIT(s, len, p) do { \
+    if (put_mem(output, s, len)) \
         QUIT; \
+    if (profiling && stack == NULL && (pr = p) != NULL) \
+        pr->emitted += len; \
+} while (0)
+
+/* Start profiling the processing of a macro call */
+#define PROF_START(p) do { \
+    if (profiling) { \
+        if ((cur_prof = p) == NULL) \
+            QUIT; \
+        ++cur_prof->calls; \
+        prof_pushed = input->pushed; \
+        prof_pushes = input->pushes; \
+        prof_start = clock(); \
+    } \
 } while (0)
 
-#define SN stack->name
+#define PROF_END do { \
+    if (profiling) \
+        prof_end(input, cur_prof, prof_start, prof_pushed, prof_pushes); \
+} while (0)
 
 #define EMSG(m) fprintf(stderr, m "\n")
 
@@ -899,14 +4153,25 @@ int main(int argc, char **argv)
 #endif
 
 /* Process built-in macro with args */
-#define PROCESS_BI_WITH_ARGS \
-    if (!strcmp(SN, "define")) { \
-        if (upsert_entry(ht, ARG(1), ARG(2))) \
+#define PROCESS_BI_WITH_ARGS switch (stack->bi) { \
+    case BI_DEFINE: \
+        if (upsert_entry(ht, ARG(1), ARG(2), BI_NONE)) \
             QUIT; \
-    } else if (!strcmp(SN, "undefine")) { \
+        ++mc->gen; \
+        break; \
+    case BI_DEFINEPURE: \
+        if (upsert_entry(ht, ARG(1), ARG(2), BI_NONE)) \
+            QUIT; \
+        if ((e = lookup_entry(ht, ARG(1), ARG_LEN(1))) != NULL) \
+            e->pure = 1; \
+        ++mc->gen; \
+        break; \
+    case BI_UNDEFINE: \
+        ++mc->gen; \
         if (delete_entry(ht, ARG(1))) \
             QUIT; \
-    } else if (!strcmp(SN, "changequote")) { \
+        break; \
+    case BI_CHANGEQUOTE: \
         if (strlen(ARG(1)) != 1 || strlen(ARG(2)) != 1 || *ARG(1) == *ARG(2) \
             || !isgraph(*ARG(1)) || !isgraph(*ARG(2)) \
             || *ARG(1) == '(' || *ARG(2) == '(' \
@@ -915,134 +4180,124 @@ int main(int argc, char **argv)
             EQUIT("changequote: quotes must be different single graph chars" \
                 " that cannot a comma or parentheses"); \
         } \
-        *left_quote = *ARG(1); \
-        *right_quote = *ARG(2); \
-    } else if (!strcmp(SN, "divert")) { \
-        if (strlen(ARG(1)) == 1 && isdigit(*ARG(1))) \
-            act_div = *ARG(1) - '0'; \
-        else if (!strcmp(ARG(1), "-1")) \
-            act_div = 10; \
-        else \
-            EQUIT("divert: Diversion number must be 0 to 9 or -1"); \
+        lq = *ARG(1); \
+        rq = *ARG(2); \
+        set_quotes(cc, lq, rq); \
+        ++mc->gen; \
+        break; \
+    case BI_DIVERT: \
+        if (*ARG(1) == '-' && !str_to_num(ARG(1) + 1, &n) && n) { \
+            /* Negative diversions are discarded */ \
+            if (divs.discard == NULL \
+                && (divs.discard = init_div(n, st)) == NULL) \
+                QUIT; \
+            act = divs.discard; \
+            act->num = n; \
+        } else if (!str_to_num(*ARG(1) == '-' ? ARG(1) + 1 : ARG(1), &n)) { \
+            if ((act = get_div(&divs, n)) == NULL) \
+                QUIT; \
+        } else { \
+            EQUIT("divert: Diversion number must be a number"); \
+        } \
+        MEMO_DIVERT; \
         SET_OUTPUT; \
-    } else if (!strcmp(SN, "dumpdef")) { \
-        for (k = 1; k < 10; ++k) { \
-            if (ISMACRO(ARG(k))) \
+        break; \
+    case BI_DUMPDEF: \
+        for (k = 1; k <= stack->act_arg; ++k) { \
+            if (ISMACRO(ARG(k), ARG_LEN(k))) \
                 fprintf(stderr, "%s: %s\n", ARG(k), \
-                    e->def == NULL ? "built-in" : e->def); \
+                    e->def == NULL ? "built-in" : e->def->a); \
             else if (*ARG(k) != '\0') \
                 fprintf(stderr, "%s: undefined\n", ARG(k)); \
         } \
-    } else if (!strcmp(SN, "errprint")) { \
-        for (k = 1; k < 10; ++k) \
+        break; \
+    case BI_ERRPRINT: \
+        for (k = 1; k <= stack->act_arg; ++k) \
             if (*ARG(k) != '\0') \
                 fprintf(stderr, "%s\n", ARG(k)); \
-    } else if (!strcmp(SN, "ifdef")) { \
-        if (ungetstr(input, ISMACRO(ARG(1)) ? ARG(2) : ARG(3))) \
-            QUIT; \
-    } else if (!strcmp(SN, "ifelse")) { \
-        if (ungetstr(input, !strcmp(ARG(1), ARG(2)) ? ARG(3) : ARG(4))) \
-            QUIT; \
-    } else if (!strcmp(SN, "include")) { \
+        break; \
+    case BI_IFDEF: \
+        k = ISMACRO(ARG(1), ARG_LEN(1)) ? 2 : 3; \
+        UNGET_ARG(k); \
+        break; \
+    case BI_IFELSE: \
+        k = !strcmp(ARG(1), ARG(2)) ? 3 : 4; \
+        UNGET_ARG(k); \
+        break; \
+    case BI_INCLUDE: \
         if (include(input, ARG(1))) { \
             fprintf(stderr, "include: Failed to include file: %s\n", ARG(1)); \
             QUIT; \
         } \
-    } else if (!strcmp(SN, "len")) { \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) strlen(ARG(1))); \
-        if (ungetstr(input, num)) \
-            QUIT; \
-    } else if (!strcmp(SN, "index")) { \
-        p = strstr(ARG(1), ARG(2)); \
-        if (p == NULL) \
-            snprintf(num, NUM_SIZE, "%d", -1); \
-        else \
-            snprintf(num, NUM_SIZE, "%lu", (unsigned long) (p - ARG(1))); \
-        if (ungetstr(input, num)) \
+        break; \
+    case BI_LEN: \
+        if (unget_num(input, ARG_LEN(1))) \
             QUIT; \
-    } else if (!strcmp(SN, "translit")) { \
-        /* Set mapping to pass through (-1) */ \
-        for (k = 0; k < UCHAR_MAX; k++) \
-            *(map + k) = -1; \
-        p = ARG(2); \
-        q = ARG(3); \
-        /* Create mapping while strings are in parallel */ \
-        while ((uc = *p++) && (uc2 = *q++)) \
-            if (*(map + uc) == -1) /* Preference to first occurrence */ \
-                *(map + uc) = uc2; \
-        /* Continue first string, setting mapping to delete (\0) */ \
-        while (uc != '\0') { \
-            *(map + uc) = '\0'; \
-            uc = *p++; \
-        } \
-        if ((tmp_str = strdup(ARG(1))) == NULL) \
+        break; \
+    case BI_INDEX: \
+        p = find_mem(ARG(1), ARG_LEN(1), ARG(2), ARG_LEN(2)); \
+        if (p == NULL ? ungetmem(input, "-1", 2) \
+            : unget_num(input, p - ARG(1))) \
             QUIT; \
-        p = ARG(1); \
-        q = tmp_str; \
-        while ((uc = *p++)) { \
-            x = *(map + uc); \
-            if (x == -1) \
-                *q++ = uc; \
-            else if (x != '\0') \
-                *q++ = x; \
-        } \
-        *q = '\0'; \
-        if (ungetstr(input, tmp_str)) \
+        break; \
+    case BI_TRANSLIT: \
+        /* Translated in place, then the argument itself is pushed */ \
+        len = tr_apply(tr_get(m->tr, ARG(2), ARG_LEN(2), ARG(3), \
+            ARG_LEN(3)), ARG(1), ARG_LEN(1)); \
+        if (len && push_buf(input, &stack->args, *(stack->arg_off + 1), \
+            len)) \
             QUIT; \
-        free(tmp_str); \
-        tmp_str = NULL; \
-    } else if (!strcmp(SN, "substr")) { \
-        if ((len = strlen(ARG(1)))) { \
+        break; \
+    case BI_SUBSTR: \
+        if ((len = ARG_LEN(1))) { \
             if (str_to_num(ARG(2), &w) || str_to_num(ARG(3), &n)) \
                 EQUIT("substr: Invalid index or length"); \
-            if (w < len) { \
-                /* Do not need to check for overflow here */ \
-                if ((tmp_str = malloc(len + 1)) == NULL) \
-                    QUIT; \
-                if (AOF(n, 1)) \
-                    QUIT; \
-                snprintf(tmp_str, MIN(len + 1, n + 1), "%s", ARG(1) + w); \
-                if (ungetstr(input, tmp_str)) \
-                    QUIT; \
-                free(tmp_str); \
-                tmp_str = NULL; \
-            } \
-        } \
-    } else if (!strcmp(SN, "undivert")) { \
-        if (!act_div) { \
-            /* In diversion 0 */ \
-            for (k = 1; k < 10; k++) \
-                if (strlen(ARG(k)) == 1 && isdigit(*ARG(k)) && *ARG(k) != '0') \
-                    OUT_DIV(*ARG(k) - '0'); \
-        } else { \
-            /* Cannot undivert division 0 or the active diversion */ \
-            for (k = 1; k < 10; k++) \
-                if (strlen(ARG(k)) == 1 && isdigit(*ARG(k)) && *ARG(k) != '0' \
-                    && (size_t) (*ARG(k) - '0') != act_div \
-                    && buf_dump_buf(DIV(act_div), DIV((*ARG(k) - '0')))) \
-                        QUIT; \
+            if (w < len && push_buf(input, &stack->args, \
+                *(stack->arg_off + 1) + w, MIN(len - w, n))) \
+                QUIT; \
         } \
-    } else if (!strcmp(SN, "dnl")) { \
+        break; \
+    case BI_UNDIVERT: \
+        /* In diversion 0, which could have batched output */ \
+        if (act == DIV0) \
+            OUT_DIV(DIV0); \
+        /* \
+         * Cannot undivert diversion 0 or the active diversion. Diversions \
+         * that have not been used are empty. Undiverting into a negative \
+         * diversion discards. \
+         */ \
+        for (k = 1; k <= stack->act_arg; ++k) \
+            if (!str_to_num(ARG(k), &n) && n \
+                && (d = find_div(&divs, n)) != NULL && d != act \
+                && (act == DIV0 ? out_div(d, out) : act == divs.discard \
+                    ? empty_div(d) : dump_div(act, d))) \
+                QUIT; \
+        break; \
+    case BI_DNL: \
         DNL; \
-    } else if (!strcmp(SN, "divnum")) { \
+        break; \
+    case BI_DIVNUM: \
         DIVNUM; \
-    } else if (!strcmp(SN, "incr")) { \
+        break; \
+    case BI_INCR: \
         if(str_to_num(ARG(1), &n)) \
             EQUIT("incr: Invalid number"); \
         if (AOF(n, 1)) \
             EQUIT("incr: Integer overflow"); \
         n += 1; \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) n); \
-        if (ungetstr(input, num)) \
+        if (unget_num(input, n)) \
             QUIT; \
-    } else if (!strcmp(SN, "htdist")) { \
+        break; \
+    case BI_HTDIST: \
         htdist(ht); \
-    } else if (!strcmp(SN, "dirsep")) { \
-        if (ungetstr(input, DIRSEP)) \
+        break; \
+    case BI_DIRSEP: \
+        if (ungetmem(input, DIRSEP, sizeof(DIRSEP) - 1)) \
             QUIT; \
-    } else if (!strcmp(SN, "add")) { \
+        break; \
+    case BI_ADD: \
         w = 0; \
-        for (k = 1; k < 10; ++k) { \
+        for (k = 1; k <= stack->act_arg; ++k) { \
             if (*ARG(k) != '\0') { \
                 if (str_to_num(ARG(k), &n)) \
                     EQUIT("add: Invalid number"); \
@@ -1051,12 +4306,12 @@ int main(int argc, char **argv)
                 w += n; \
             } \
         } \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) w); \
-        if (ungetstr(input, num)) \
+        if (unget_num(input, w)) \
             QUIT; \
-    } else if (!strcmp(SN, "mult")) { \
+        break; \
+    case BI_MULT: \
         w = 1; \
-        for (k = 1; k < 10; ++k) { \
+        for (k = 1; k <= stack->act_arg; ++k) { \
             if (*ARG(k) != '\0') { \
                 if (str_to_num(ARG(k), &n)) \
                     EQUIT("mult: Invalid number"); \
@@ -1065,15 +4320,15 @@ int main(int argc, char **argv)
                 w *= n; \
             } \
         } \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) w); \
-        if (ungetstr(input, num)) \
+        if (unget_num(input, w)) \
             QUIT; \
-    } else if (!strcmp(SN, "sub")) { \
+        break; \
+    case BI_SUB: \
         if (*ARG(1) == '\0') \
             EQUIT("sub: Argument 1 must be used"); \
         if (str_to_num(ARG(1), &w)) \
             EQUIT("sub: Invalid number"); \
-        for (k = 2; k < 10; ++k) { \
+        for (k = 2; k <= stack->act_arg; ++k) { \
             if (*ARG(k) != '\0') { \
                 if (str_to_num(ARG(k), &n)) \
                     EQUIT("sub: Invalid number"); \
@@ -1082,15 +4337,15 @@ int main(int argc, char **argv)
                 w -= n; \
             } \
         } \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) w); \
-        if (ungetstr(input, num)) \
+        if (unget_num(input, w)) \
             QUIT; \
-    } else if (!strcmp(SN, "div")) { \
+        break; \
+    case BI_DIV: \
         if (*ARG(1) == '\0') \
             EQUIT("div: Argument 1 must be used"); \
         if (str_to_num(ARG(1), &w)) \
             EQUIT("div: Invalid number"); \
-        for (k = 2; k < 10; ++k) { \
+        for (k = 2; k <= stack->act_arg; ++k) { \
             if (*ARG(k) != '\0') { \
                 if (str_to_num(ARG(k), &n)) \
                     EQUIT("div: Invalid number"); \
@@ -1099,15 +4354,37 @@ int main(int argc, char **argv)
                 w /= n; \
             } \
         } \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) w); \
-        if (ungetstr(input, num)) \
+        if (unget_num(input, w)) \
             QUIT; \
-    } else if (!strcmp(SN, "mod")) { \
+        break; \
+    case BI_EVAL: \
+        w = 10; \
+        n = 1; \
+        if (*ARG(2) != '\0' \
+            && (str_to_num(ARG(2), &w) || w < 2 || w > 36)) \
+            EQUIT("eval: Radix must be from 2 to 36"); \
+        if (*ARG(3) != '\0' \
+            && (str_to_num(ARG(3), &n) || n > EVAL_WIDTH)) \
+            EQUIT("eval: Width must be at most 64"); \
+        switch (eval_str(ARG(1), &val)) { \
+        case EVAL_SYNTAX: \
+            EQUIT("eval: Invalid expression"); \
+        case EVAL_RANGE: \
+            EQUIT("eval: Number or nesting too large"); \
+        case EVAL_DIV_ZERO: \
+            EQUIT("eval: Divide by zero"); \
+        case EVAL_NEG_EXP: \
+            EQUIT("eval: Negative exponent"); \
+        } \
+        if (unget_snum(input, val, w, n)) \
+            QUIT; \
+        break; \
+    case BI_MOD: \
         if (*ARG(1) == '\0') \
             EQUIT("mod: Argument 1 must be used"); \
         if (str_to_num(ARG(1), &w)) \
             EQUIT("mod: Invalid number"); \
-        for (k = 2; k < 10; ++k) { \
+        for (k = 2; k <= stack->act_arg; ++k) { \
             if (*ARG(k) != '\0') { \
                 if (str_to_num(ARG(k), &n)) \
                     EQUIT("mod: Invalid number"); \
@@ -1116,89 +4393,165 @@ int main(int argc, char **argv)
                 w %= n; \
             } \
         } \
-        snprintf(num, NUM_SIZE, "%lu", (unsigned long) w); \
-        if (ungetstr(input, num)) \
+        if (unget_num(input, w)) \
             QUIT; \
+        break; \
+    PROCESS_BI_WITH_ARGS_EXTRA \
     }
 
 #if ESYSCMD_MAKETEMP
-/* These tag onto the end of the list of built-in macros with args */
+/* These tag onto the end of the built-in macros with args switch */
 #define PROCESS_BI_WITH_ARGS_EXTRA \
-    else if (!strcmp(SN, "maketemp")) { \
+    case BI_MAKETEMP: \
         /* ARG(1) is the template string which is modified in-place */ \
         MAKETEMP(ARG(1)); \
-        if (ungetstr(input, ARG(1))) \
+        if (ungetmem(input, ARG(1), ARG_LEN(1))) \
             QUIT; \
-    } else if (!strcmp(SN, "esyscmd")) { \
-        if (esyscmd(input, tmp_buf, ARG(1))) \
+        break; \
+    case BI_ESYSCMD: \
+        if (esyscmd(input, ARG(1), stack->act_arg)) \
             EQUIT("esyscmd: Failed"); \
-    }
+        break;
+#else
+#define PROCESS_BI_WITH_ARGS_EXTRA
 #endif
 
 
 /* Process built-in macro with no arguments */
-#define PROCESS_BI_NO_ARGS do { \
-    if (!strcmp(TS, "dnl")) { \
+#define PROCESS_BI_NO_ARGS switch (e->bi) { \
+    case BI_DNL: \
         DNL; \
-    } else if (!strcmp(TS, "divnum")) { \
+        break; \
+    case BI_DIVNUM: \
         DIVNUM; \
-    } else if (!strcmp(TS, "undivert")) { \
-        if (act_div) \
+        break; \
+    case BI_UNDIVERT: \
+        if (act != DIV0) \
             EQUIT("undivert: Can only call from diversion 0" \
                 " when called without arguments"); \
         UNDIVERT_ALL; \
-    } else if (!strcmp(TS, "divert")) { \
-        act_div = 0; \
+        break; \
+    case BI_DIVERT: \
+        act = DIV0; \
+        MEMO_DIVERT; \
         SET_OUTPUT; \
-    } else if (!strcmp(TS, "htdist")) { \
+        break; \
+    case BI_HTDIST: \
         htdist(ht); \
-    } else if (!strcmp(TS, "dirsep")) { \
-        if (ungetstr(input, DIRSEP)) \
+        break; \
+    case BI_DIRSEP: \
+        if (ungetmem(input, DIRSEP, sizeof(DIRSEP) - 1)) \
             QUIT; \
-    } else { \
-        /* The remaining macros must take arguments, so pass through */ \
-        if (put_str(output, TS)) \
+        break; \
+    case BI_PROFILE: \
+        if (prof_dump(profs)) \
             QUIT; \
-    } \
-} while (0)
+        break; \
+    case BI_STATS: \
+        STATS_DUMP; \
+        break; \
+    default: \
+        /* \
+         * The remaining macros must take arguments, so pass through. \
+         * The name is used, as the token may not have survived. \
+         */ \
+        if (put_str(output, e->name)) \
+            QUIT; \
+        break; \
+    }
 
 
     /* m4 loop: read input word by word */
     while (1) {
-        /* Write diversion 0 (for interactive use) */
-        OUT_DIV(0);
+        MEMO_CHECK;
+        /* Write diversion 0 every token when interactive, else in batches */
+        if (interactive || DIV0->b->i >= out_threshold)
+            OUT_DIV(DIV0);
+        /* Negative diversions are discarded, others spill past budget */
+        if (act == divs.discard)
+            act->b->i = 0;
+        else if (act != DIV0) {
+            if ((k = act->len + act->b->i) > st->div)
+                st->div = k;
+            if (k >= div_budget) {
+                if (mc->on && act->b == mc->out)
+                    memo_stop(mc, input);
+                if (spill_div(act))
+                    QUIT;
+            }
+        }
+        /*
+         * Copy the rest of the quoted text in the frame in one go, unless a
+         * quote char can be in a word, so words must be read
+         */
+        if (quote_on && (f = input->top) != NULL && f->i < f->s
+            && !((*(cc + lq) | *(cc + rq)) & CC_IDENT)) {
+            n = quoted_len(f->a + f->i, f->s - f->i, cc, lq, rq,
+                           &quote_depth);
+            EMIT(f->a + f->i, quote_depth ? n : n - 1, frame_prof(input));
+            f->i += n;
+            if (!quote_depth)
+                quote_on = 0;
+            continue;
+        }
+        /* Copy a run of plain text straight through, without tokens */
+        if ((f = input->top) != NULL && f->i < f->s
+            && (n = plain_len(f->a + f->i, f->s - f->i, cc,
+                              quote_on ? CC_QUOTE_PLAIN : stack != NULL
+                              ? CC_ARG_PLAIN : CC_PLAIN, lq, rq))) {
+            EMIT(f->a + f->i, n, frame_prof(input));
+            f->i += n;
+            /* Before reading a token pops the frame */
+            MEMO_CHECK;
+        }
         /* Read token */
         READ_TOKEN(token);
+        ++st->tokens;
 
-        if (!strcmp(TS, left_quote)) {
+        if (TK == TOK_LQ) {
             if (!quote_on)
                 quote_on = 1;
-            if (quote_depth && put_str(output, TS))
-                QUIT;
+            if (quote_depth)
+                EMIT(TS, TL, token.prof);
             ++quote_depth;
-        } else if (!strcmp(TS, right_quote)) {
-            if (quote_depth > 1 && put_str(output, TS))
-                QUIT;
+        } else if (TK == TOK_RQ) {
+            if (quote_depth > 1)
+                EMIT(TS, TL, token.prof);
             if (!--quote_depth)
                 quote_on = 0;
         } else if (quote_on) {
-            if (put_str(output, TS))
-                QUIT;
-        } else if (ISMACRO(TS)) {
+            EMIT(TS, TL, token.prof);
+        } else if (TK == TOK_WORD
+                   && (e = lookup_entry(ht, TS, TL)) != NULL) {
             /* Token match */
-            READ_TOKEN(next_token);
+            ++st->calls;
+            /* A call that ends the expansion reads on past it */
+            if (mc->on && input->memo_word)
+                memo_stop(mc, input);
+            err = 0;
+            if (getword(&next_token, input, cc, &err)) {
+                if (err)
+                    QUIT;
+                /* End of input, so this is a call without arguments */
+                NTK = TOK_OTHER;
+                NTL = 0;
+            }
 
-            if (!strcmp(NTS, "(")) {
+            if (NTK == TOK_OPEN) {
                 /* Start of macro with arguments */
                 /* Add macro call to stack */
-                if (stack_on_mcall(&stack))
-                    QUIT;
-                /* Copy macro name */
-                if ((stack->name = strdup(TS)) == NULL)
+                if (stack_on_mcall(&stack, &pool, &pool_n, st))
                     QUIT;
-                /* Copy macro definition (built-ins will be NULL) */
-                if (e->def != NULL
-                    && (stack->def = strdup(e->def)) == NULL)
+                stack->bi = e->bi;
+                stack->pure = e->pure;
+                /*
+                 * Hold the macro definition (built-ins will be NULL), so
+                 * that it survives redefinition during argument collection
+                 */
+                if ((stack->def = e->def) != NULL)
+                    ++stack->def->refs;
+                stack->prof = NULL;
+                if (profiling && (stack->prof = get_prof(&profs, e)) == NULL)
                     QUIT;
                 /* Increment bracket depth for this first bracket */
                 ++stack->bracket_depth;
@@ -1207,64 +4560,96 @@ int main(int argc, char **argv)
             } else {
                 /* Macro call without arguments (stack is not used) */
                 /* Put the next token back into the input */
-                if (ungetstr(input, NTS))
+                if (ungetmem(input, NTS, NTL))
                     QUIT;
+                PROF_START(get_prof(&profs, e));
                 if (e->def == NULL) {
                     /* Built-in macro */
                     PROCESS_BI_NO_ARGS;
                 } else {
-                    /* User defined macro */
-                    /* Strip dollar argument positions from definition */
-                    if ((sd = strip_def(e->def)) == NULL)
+                    /* User defined macro, without the argument positions */
+                    if (push_def(input, e->def))
                         QUIT;
-                    if (ungetstr(input, sd))
-                        QUIT;
-                    free(sd);
-                    sd = NULL;
                 }
+                PROF_END;
             }
         } else if (ARG_END) {
             /* End of argument collection */
+            MEMO_DELIM;
             /* Decrement bracket depth for bracket just encountered */
             --stack->bracket_depth;
+            if (terminate_args(stack))
+                QUIT;
+            if (stack->args->i > st->args)
+                st->args = stack->args->i;
+            PROF_START(stack->prof);
+            if (stack->def != NULL && stack->pure
+                && (hit = memo_get(mc, stack)) != NULL) {
+                if (memo_fuses(hit, input, cc, &err))
+                    QUIT;
+                if (err || (stack->next != NULL && !hit->args_ok))
+                    hit = NULL;
+            }
             if (stack->def == NULL) {
                 /* Built-in macro */
-                if (terminate_args(stack))
-                    QUIT;
                 /* Deliberately no semicolons after these macro calls */
                 PROCESS_BI_WITH_ARGS
-#if ESYSCMD_MAKETEMP
-                    PROCESS_BI_WITH_ARGS_EXTRA
-#endif
+            } else if (hit != NULL) {
+                /* Pure macro called with the same arguments as before */
+                ++st->memo_hits;
             } else {
                 /* User defined macro */
-                if (sub_args(result, stack))
+                if (sub_args(result, stack, lq, rq))
                     QUIT;
-                if (ungetstr(input, result->a))
+                if (result->i > st->result)
+                    st->result = result->i;
+                /* Record a pure macro, unless one is being recorded */
+                if (stack->pure) {
+                    ++st->memo_misses;
+                    if (!mc->on && act != divs.discard) {
+                        if (memo_start(mc, input, stack))
+                            QUIT;
+                        /* Nothing is pushed, so the expansion is done */
+                        if (mc->on && !result->i
+                            && memo_end(mc, input, result->a, 0))
+                            QUIT;
+                    }
+                }
+                n = result->i;
+                if (push_buf(input, &result, 0, result->i))
                     QUIT;
+                if (mc->on && mc->out == NULL && n)
+                    input->top->memo = 1;
             }
+            PROF_END;
             REMOVE_SH;
+            if (hit != NULL) {
+                EMIT(hit->out, hit->out_len, NULL);
+                hit = NULL;
+            } else if (mc->on && mc->out == NULL) {
+                mc->stack = stack;
+                mc->act = act;
+                mc->out = output;
+                mc->off = output->i;
+            }
         } else if (ARG_COMMA) {
-            if (stack->act_arg == 9)
-                EQUIT("Macro call has too many arguments");
-            /* Allocate buffer for argument collection */
-            if ((*(stack->arg_buf + ++stack->act_arg) =
-                 init_buf()) == NULL)
+            /* Start collecting the next argument */
+            MEMO_DELIM;
+            if (next_arg(stack))
                 QUIT;
             SET_OUTPUT;
             EAT_WS;
         } else if (NESTED_CB) {
-            if (put_str(output, TS))
-                QUIT;
+            MEMO_DELIM;
+            EMIT(TS, TL, token.prof);
             --stack->bracket_depth;
         } else if (NESTED_OB) {
-            if (put_str(output, TS))
-                QUIT;
+            MEMO_DELIM;
+            EMIT(TS, TL, token.prof);
             ++stack->bracket_depth;
         } else {
             /* Pass through token */
-            if (put_str(output, TS))
-                QUIT;
+            EMIT(TS, TL, token.prof);
         }
     }
 
@@ -1279,16 +4664,222 @@ int main(int argc, char **argv)
     UNDIVERT_ALL;
 
   clean_up:
-    free_buf(input);
-    free_buf(token);
-    free_buf(next_token);
-    free_buf(result);
-    free_buf(tmp_buf);
-    for (k = 0; k < 11; ++k)
-        free_buf(*(diversion + k));
-    free_hash_table(ht);
-    free_stack(stack);
-    free(sd);
-    free(tmp_str);
+    if (mc->on)
+        memo_stop(mc, input);
+    /*
+     * Text before an error is still written, as it would have been had
+     * diversion 0 been written every token, before the reset discards it
+     */
+    if (ret)
+        out_div(DIV0, out);
+    m->result = result;
+    m->divs = divs;
+    m->act = act;
+    m->lq = lq;
+    m->rq = rq;
+    m->quote_on = quote_on;
+    m->quote_depth = quote_depth;
+    m->stack = stack;
+    m->pool = pool;
+    m->pool_n = pool_n;
+    m->profs = profs;
+    if (ret)
+        reset_m4(m);
+    return ret;
+}
+
+int run_job(struct m4 *m, char *fn)
+{
+    /* Expands a file on its own into fn with JOB_EXT appended */
+    char *out_fn;
+    FILE *fp;
+    size_t len = strlen(fn);
+    int ret = 0;
+    if (AOF(len, sizeof(JOB_EXT)) || (out_fn = malloc(len + sizeof(JOB_EXT)))
+        == NULL)
+        return 1;
+    memcpy(out_fn, fn, len);
+    memcpy(out_fn + len, JOB_EXT, sizeof(JOB_EXT));
+    /* The input is checked first, so that no output is made without it */
+    if (feed_file(m, fn) || (fp = fopen(out_fn, "wb")) == NULL) {
+        ret = 1;
+    } else {
+        if (expand(m, fp))
+            ret = 1;
+        if (fclose(fp))
+            ret = 1;
+    }
+    if (ret)
+        fprintf(stderr, "Failed to expand file: %s\n", fn);
+    free(out_fn);
+    return ret;
+}
+
+int run_jobs(struct m4 *m, char *frozen, char **fn, size_t num,
+             size_t jobs)
+{
+    /*
+     * Expands each file on its own, in up to jobs processes at a time.
+     * Each process starts from m and only copies the pages that it writes
+     * to, so the definitions of m are shared. Processes are not used on
+     * Windows, where the files are expanded in turn, each by a new
+     * processor with the options of m, made from the frozen file if given.
+     */
+#ifndef _WIN32
+    size_t k = 0, running = 0;
+    pid_t pid;
+    int status, ret = 0;
+    (void) frozen;
+    if (fflush(NULL))
+        return 1;
+    while (k < num || running) {
+        if (k < num && running < jobs) {
+            if ((pid = fork()) == -1) {
+                /* Do not start any more, but wait for the others */
+                ret = 1;
+                k = num;
+                continue;
+            }
+            if (!pid)
+                _exit(run_job(m, *(fn + k)));
+            ++k;
+            ++running;
+        } else {
+            if (wait(&status) == -1)
+                return 1;
+            --running;
+            if (!WIFEXITED(status) || WEXITSTATUS(status))
+                ret = 1;
+        }
+    }
+    return ret;
+#else
+    struct m4 *t;
+    size_t k;
+    int ret = 0;
+    (void) jobs;
+    for (k = 0; k < num; ++k) {
+        if ((t = init_m4(frozen)) == NULL)
+            return 1;
+        t->div_budget = m->div_budget;
+        if ((!m->interactive && batch_output(t, m->out_threshold))
+            || run_job(t, *(fn + k)))
+            ret = 1;
+        if (free_m4(t))
+            ret = 1;
+    }
+    return ret;
+#endif
+}
+
+#ifndef M4_NO_MAIN
+int main(int argc, char **argv)
+{
+    int ret = 0, j, fi, interactive = -1, profiling = 0, show_stats = 0;
+    size_t out_threshold = OUT_THRESHOLD, div_budget = DIV_BUDGET, jobs = 0;
+    char *freeze_fn = NULL, *thaw_fn = NULL;
+    struct m4 *m;
+
+    if (argc < 1)
+        return 1;
+
+    /* Options */
+    for (j = 1; j < argc && **(argv + j) == '-'; ++j) {
+        if (!strcmp(*(argv + j), "--")) {
+            ++j;
+            break;
+        } else if (!strcmp(*(argv + j), "-i")) {
+            interactive = 1;
+        } else if (!strcmp(*(argv + j), "-b") && j + 1 < argc
+                   && !str_to_num(*(argv + j + 1), &out_threshold)) {
+            interactive = 0;
+            ++j;
+        } else if (!strcmp(*(argv + j), "-d") && j + 1 < argc
+                   && !str_to_num(*(argv + j + 1), &div_budget)) {
+            ++j;
+        } else if (!strcmp(*(argv + j), "-p")) {
+            profiling = 1;
+        } else if (!strcmp(*(argv + j), "-s")) {
+            show_stats = 1;
+        } else if (!strcmp(*(argv + j), "-F") && j + 1 < argc) {
+            freeze_fn = *(argv + ++j);
+        } else if (!strcmp(*(argv + j), "-R") && j + 1 < argc) {
+            thaw_fn = *(argv + ++j);
+        } else if (!strcmp(*(argv + j), "-j") && j + 1 < argc
+                   && !str_to_num(*(argv + j + 1), &jobs) && jobs) {
+            ++j;
+        } else {
+            goto usage;
+        }
+    }
+    /* Index of the first command line file */
+    fi = j;
+    /* Jobs expand files on their own, so there is nothing to freeze */
+    if (jobs && (fi == argc || freeze_fn != NULL || profiling || show_stats
+                 || interactive == 1))
+        goto usage;
+    /* Batch mode unless reading from a terminal */
+    if (interactive == -1)
+        interactive = fi == argc && isatty(fileno(stdin));
+
+#ifdef _WIN32
+    if (_setmode(_fileno(stdin), _O_BINARY) == -1)
+        return 1;
+    if (_setmode(_fileno(stdout), _O_BINARY) == -1)
+        return 1;
+    if (_setmode(_fileno(stderr), _O_BINARY) == -1)
+        return 1;
+#endif
+
+    if ((m = init_m4(thaw_fn)) == NULL) {
+        if (thaw_fn != NULL)
+            fprintf(stderr, "Failed to load frozen file: %s\n", thaw_fn);
+        return 1;
+    }
+    m->div_budget = div_budget;
+    m->profiling = profiling;
+
+    if (!interactive) {
+        if (batch_output(m, out_threshold))
+            QUIT;
+        /* Large writes go straight through, so stdio does not split them */
+        if (setvbuf(stdout, NULL, _IONBF, 0))
+            QUIT;
+    }
+
+    if (jobs) {
+        if (run_jobs(m, thaw_fn, argv + fi, argc - fi, jobs))
+            QUIT;
+        goto clean_up;
+    }
+
+    /* Read stdin once the files are done, unless there are files */
+    m->input->read_stdin = fi == argc;
+    /* Stack command line files, so that the first file is read first */
+    for (j = argc - 1; j >= fi; --j)
+        if (feed_file(m, *(argv + j)))
+            QUIT;
+
+    if (expand(m, stdout))
+        QUIT;
+
+    if (profiling && prof_dump(m->profs))
+        QUIT;
+    if (show_stats)
+        stats_dump(m);
+    if (freeze_fn != NULL && freeze(m->ht, m->lq, m->rq, freeze_fn)) {
+        fprintf(stderr, "Failed to write frozen file: %s\n", freeze_fn);
+        QUIT;
+    }
+
+  clean_up:
+    if (free_m4(m))
+        ret = 1;
     return ret;
+
+  usage:
+    fprintf(stderr, "Usage: %s [-i] [-b bytes] [-d bytes] [-p] [-s]"
+            " [-F file] [-R file] [-j jobs] [file...]\n", *argv);
+    return 1;
 }
+#endif
@@ -0,0 +1,17 @@
+dnl Cached pure macro expansions must match expanding them again.
+dnl Each case calls the macro more than once so the later calls hit.
+dnl An argument comma from a pure macro inside an enclosing call
+definepure(`p', `a,``b''')dnl
+define(`show', `[$1][$2]')dnl
+show(p(1))show(p(1))show(p(1))
+dnl Bodies that end in plain text or a word
+definepure(`pt', `<$1>')dnl
+definepure(`pw', `x$1y')dnl
+pt(1) pt(1) pt(2) pt(1)
+pw(1) pw(1) pw(1)pw(1) pw(1).pw(1)
+dnl A word at the end is read on into the text after it
+define(`x1yz', `fused')dnl
+pw(1)z pw(1) pw(1)z
+dnl Brackets and commas that were plain text, output again in arguments
+definepure(`pc', `a)b,c')dnl
+pc(1) pc(1) show(pc(1)) show(pc(1))